@@ -1,10 +1,27 @@
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <map>
-#include <regex>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ASMC_SIMD 1
+#endif
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define ASMC_JIT 1
+#endif
 using namespace std;
 #define MAX_LENGTH 200
 
@@ -19,6 +36,8 @@ enum class Inst {
     CE,
     INVALID
 };
+// Mnemonic of every opcode before Inst::CE, indexed by Inst.
+static const char *const inst_names[] = {"add", "sub", "mul", "div", "rem", "store", "load"};
 enum class Data {
     MEM,
     REG,
@@ -37,56 +56,84 @@ struct ASM {
     } op[3];
     ASM() : inst(Inst::INVALID) {
     }
-    ASM(const string &in) : ASM() {
-        static char t1[30], t2[3][30];
-        if (in == "Compile Error!")
+    // Decode [begin, end) in a single pass. The accepted syntax is "op rD (rS|imm) (rS|imm)",
+    // "load rD [addr]" and "store [addr] rS" with one or more spaces between fields and only
+    // spaces after the last one.
+    ASM(const char *begin, const char *end) : ASM() {
+        const char *p = begin;
+        if (end - begin == 14 && !memcmp(begin, "Compile Error!", 14)) {
             inst = Inst::CE;
-        else if (regex_match(in, regex(R"(^(add|sub|mul|div|rem) +r[0-9]+ +(r[0-9]+|[0-9]+) +(r[0-9]+|[0-9]+) *$)"))) {
-            sscanf(in.c_str(), "%s%s%s%s", t1, t2[0], t2[1], t2[2]);
-            if (!strcmp(t1, "add"))
-                inst = Inst::ADD;
-            else if (!strcmp(t1, "sub"))
-                inst = Inst::SUB;
-            else if (!strcmp(t1, "mul"))
-                inst = Inst::MUL;
-            else if (!strcmp(t1, "div"))
-                inst = Inst::DIV;
-            else
-                inst = Inst::REM;
-            for (int i = 0, tmp; i < 3; i++) {
-                if (t2[i][0] == 'r') {
-                    sscanf(t2[i], "r%d", &tmp);
-                    op[i] = Operand(tmp, Data::REG);
-                    if (tmp >= 256 || tmp < 0)
-                        inst = Inst::INVALID;
-                } else {
-                    sscanf(t2[i], "%d", &tmp);
-                    op[i] = Operand(tmp, Data::VAL);
-                    if (tmp < 0)
-                        inst = Inst::INVALID;
-                }
-            }
-        } else if (regex_match(in, regex(R"(^load +r[0-9]+ +\[[0-9]+\] *$)"))) {
-            sscanf(in.c_str(), "%*s r%d [%d]", &op[0].val, &op[1].val);
-            inst = Inst::LOAD;
-            op[0].type = Data::REG;
-            op[1].type = Data::MEM;
-            if (op[0].val >= 256 || op[0].val < 0)
-                inst = Inst::INVALID;
-            if (op[1].val >= 256 || op[1].val < 0)
-                inst = Inst::INVALID;
-        } else if (regex_match(in, regex(R"(^store +\[[0-9]+\] +r[0-9]+ *$)"))) {
-            sscanf(in.c_str(), "%*s [%d] r%d", &op[0].val, &op[1].val);
-            inst = Inst::STORE;
-            op[0].type = Data::MEM;
-            op[1].type = Data::REG;
-            if (op[0].val >= 256 || op[0].val < 0)
-                inst = Inst::INVALID;
-            if (op[1].val >= 256 || op[1].val < 0)
-                inst = Inst::INVALID;
+            return;
         }
+        int kind = 0;
+        while (kind < (int)Inst::CE && !scan_word(p, end, inst_names[kind]))
+            kind++;
+        if (kind == (int)Inst::CE)
+            return;
+        bool ok;
+        if (kind == (int)Inst::LOAD)
+            ok = scan_operand(p, end, op[0], 'r') && scan_operand(p, end, op[1], '[');
+        else if (kind == (int)Inst::STORE)
+            ok = scan_operand(p, end, op[0], '[') && scan_operand(p, end, op[1], 'r');
+        else
+            ok = scan_operand(p, end, op[0], 'r') && scan_operand(p, end, op[1], 0) && scan_operand(p, end, op[2], 0);
+        while (p != end && *p == ' ')
+            p++;
+        if (!ok || p != end)
+            return;
+        inst = (Inst)kind;
+        for (const auto &o : op)
+            if ((o.type != Data::INVALID && o.val < 0) || (o.type != Data::VAL && o.val >= 256))
+                inst = Inst::INVALID;
+    }
+    ASM(const string &in) : ASM(in.data(), in.data() + in.size()) {
+    }
+    ASM(const char *in) : ASM(in, in + strlen(in)) {
+    }
+
+  private:
+    // Return false if [p, end) does not start with the word followed by a space.
+    static bool scan_word(const char *&p, const char *end, const char *word) {
+        size_t len = strlen(word);
+        if ((size_t)(end - p) <= len || memcmp(p, word, len) || p[len] != ' ')
+            return false;
+        p += len;
+        return true;
+    }
+    // Return false if no digits follow. Values that do not fit in an int become -1 so the
+    // range checks reject them.
+    static bool scan_number(const char *&p, const char *end, int &val) {
+        long long res = 0;
+        if (p == end || *p < '0' || *p > '9')
+            return false;
+        for (; p != end && '0' <= *p && *p <= '9'; p++)
+            if (res <= INT_MAX)
+                res = res * 10 + (*p - '0');
+        val = res > INT_MAX ? -1 : (int)res;
+        return true;
     }
-    ASM(const char *in) : ASM(string(in)) {
+    // Skip the separating spaces and read a register ('r'), an address ('[') or, when form
+    // is 0, either a register or an immediate.
+    static bool scan_operand(const char *&p, const char *end, Operand &res, char form) {
+        if (p == end || *p != ' ')
+            return false;
+        while (p != end && *p == ' ')
+            p++;
+        if (p == end)
+            return false;
+        if (*p == 'r' && form != '[') {
+            res.type = Data::REG;
+            return scan_number(++p, end, res.val);
+        }
+        if (*p == '[' && form == '[') {
+            res.type = Data::MEM;
+            if (!scan_number(++p, end, res.val) || p == end || *p != ']')
+                return false;
+            p++;
+            return true;
+        }
+        res.type = Data::VAL;
+        return form == 0 && scan_number(p, end, res.val);
     }
 };
 struct REG {
@@ -109,6 +156,9 @@ struct REG {
 };
 struct MEM {
     const static int MAX = 256;
+    // Byte size of the flat memory the faster engines use: an int read at the last addresses
+    // still stays inside the array.
+    const static int PADDED = MAX + sizeof(int);
     char *val;
     MEM() {
         val = new char[MAX];
@@ -128,16 +178,59 @@ struct MEM {
     }
 };
 vector<ASM> asm_list;
+vector<int> asm_lines;  // Input line of each entry of asm_list.
 
 // Return false if the ASM is invalid.
-bool insert_ASM(const string &in) {
-    if (regex_match(in, regex(R"(^ *$)")))
+bool insert_ASM(const char *begin, const char *end, vector<ASM> &list = asm_list) {
+    const char *p = begin;
+    while (p != end && *p == ' ')
+        p++;
+    if (p == end)
         return true;
-    asm_list.emplace_back(ASM(in));
-    if (asm_list.back().inst == Inst::INVALID)
+    list.emplace_back(begin, end);
+    if (list.back().inst == Inst::INVALID)
         return false;
     return true;
 }
+bool insert_ASM(const string &in) {
+    return insert_ASM(in.data(), in.data() + in.size());
+}
+
+// Hands out the lines of stdin as ranges inside one growing buffer, without copying them.
+// read() returns as soon as a line is typed, so "print" still works interactively.
+struct LineReader {
+    vector<char> buf;
+    size_t begin, end;
+    bool eof;
+    LineReader() : buf(1 << 16), begin(0), end(0), eof(false) {
+    }
+    // Return false when the input is exhausted.
+    bool next(const char *&line, const char *&line_end) {
+        while (true) {
+            char *nl = (char *)memchr(buf.data() + begin, '\n', end - begin);
+            if (nl != nullptr || (eof && begin != end)) {
+                line = buf.data() + begin;
+                line_end = nl != nullptr ? nl : buf.data() + end;
+                begin = nl != nullptr ? nl - buf.data() + 1 : end;
+                return true;
+            }
+            if (eof)
+                return false;
+            if (begin != 0) {  // Move the partial line to the front before reading more.
+                memmove(buf.data(), buf.data() + begin, end - begin);
+                end -= begin;
+                begin = 0;
+            }
+            if (end == buf.size())
+                buf.resize(buf.size() * 2);
+            ssize_t len = read(STDIN_FILENO, buf.data() + end, buf.size() - end);
+            if (len <= 0)
+                eof = true;
+            else
+                end += len;
+        }
+    }
+};
 
 // Return -1 if there exists a "CE" instruction.
 tuple<int, int, int> evaluate(const vector<ASM> &list, const vector<int> &xyz = vector<int>()) {
@@ -193,76 +286,1020 @@ tuple<int, int, int> evaluate(const vector<ASM> &list, const vector<int> &xyz =
     return {mem.rw(0), mem.rw(4), mem.rw(8)};
 }
 
-// Return -1 if there exists a "CE" instruction.
-int cycle(const vector<ASM> &list) {
+// evaluate() checks operand types and bounds on every step. ThreadedProgram checks them once
+// when the program is loaded and lowers each ASM to a handler address plus three slot
+// indices: registers are slot[0, 256) and the immediates of the program follow them, so
+// every operand is a plain array access.
+class ThreadedProgram {
+  public:
+    // Return false if an operand is out of range.
+    bool load(const vector<ASM> &list) {
+        const void *const *labels = execute(nullptr, nullptr, nullptr);
+        code.clear();
+        slots.assign(REG::MAX, 0);
+        for (const auto &i : list) {
+            Step step = {i.inst, nullptr, 0, 0, 0};
+            switch (i.inst) {
+            case Inst::ADD:
+            case Inst::SUB:
+            case Inst::MUL:
+            case Inst::DIV:
+            case Inst::REM:
+                step.dst = operand_slot(i.op[0]);
+                step.src1 = operand_slot(i.op[1]);
+                step.src2 = operand_slot(i.op[2]);
+                if (i.op[0].type != Data::REG || step.src1 == -1 || step.src2 == -1)
+                    return false;
+                break;
+            case Inst::LOAD:
+                step.dst = operand_slot(i.op[0]);
+                step.src1 = i.op[1].val;
+                if (i.op[0].type != Data::REG || step.dst == -1 || i.op[1].type != Data::MEM)
+                    return false;
+                break;
+            case Inst::STORE:
+                step.dst = i.op[0].val;
+                step.src1 = operand_slot(i.op[1]);
+                if (i.op[0].type != Data::MEM || i.op[1].type != Data::REG || step.src1 == -1)
+                    return false;
+                break;
+            case Inst::CE:
+                break;
+            default:
+                return false;
+            }
+            if (step.dst < 0 || step.dst >= MEM::MAX)
+                return false;
+            step.handler = labels[(int)step.inst];
+            code.push_back(step);
+            if (i.inst == Inst::CE)  // Nothing after it runs.
+                return true;
+        }
+        code.push_back({Inst::CE, labels[(int)Inst::CE], 0, 0, 0});
+        return true;
+    }
+    tuple<int, int, int> run(const vector<int> &xyz = vector<int>()) const {
+        vector<int> slot(slots);
+        char mem[MEM::PADDED] = {0};
+        int val[3];
+        for (int i = 0; i < (int)xyz.size(); i++)
+            memcpy(mem + i * 4, &xyz[i], sizeof(int));
+        execute(code.data(), slot.data(), mem);
+        for (int i = 0; i < 3; i++)
+            memcpy(&val[i], mem + i * 4, sizeof(int));
+        return {val[0], val[1], val[2]};
+    }
+
+  private:
+    struct Step {
+        Inst inst;
+        const void *handler;
+        int dst, src1, src2;
+    };
+    vector<Step> code;
+    vector<int> slots;  // Registers followed by the immediates.
+
+    // Return -1 if the operand is out of range.
+    int operand_slot(const ASM::Operand &op) {
+        if (op.type == Data::VAL && op.val >= 0) {
+            slots.push_back(op.val);
+            return (int)slots.size() - 1;
+        }
+        if (op.type == Data::REG && 0 <= op.val && op.val < REG::MAX)
+            return op.val;
+        return -1;
+    }
+    // Called with pc == nullptr it only returns the handler table, indexed by Inst.
+    static const void *const *execute(const Step *pc, int *slot, char *mem) {
+#if defined(__GNUC__)
+        static const void *const labels[] = {&&add, &&sub, &&mul, &&div, &&rem, &&store, &&load, &&halt};
+        if (pc == nullptr)
+            return labels;
+#define NEXT() goto *(++pc)->handler
+        goto *pc->handler;
+#else
+        static const void *const labels[8] = {};  // Unused: dispatch goes through the switch below.
+        if (pc == nullptr)
+            return labels;
+#define NEXT()       \
+    do {             \
+        ++pc;        \
+        goto dispatch; \
+    } while (0)
+    dispatch:
+        switch (pc->inst) {
+        case Inst::ADD:
+            goto add;
+        case Inst::SUB:
+            goto sub;
+        case Inst::MUL:
+            goto mul;
+        case Inst::DIV:
+            goto div;
+        case Inst::REM:
+            goto rem;
+        case Inst::STORE:
+            goto store;
+        case Inst::LOAD:
+            goto load;
+        default:
+            goto halt;
+        }
+#endif
+    add:
+        slot[pc->dst] = (int)((unsigned)slot[pc->src1] + (unsigned)slot[pc->src2]);
+        NEXT();
+    sub:
+        slot[pc->dst] = (int)((unsigned)slot[pc->src1] - (unsigned)slot[pc->src2]);
+        NEXT();
+    mul:
+        slot[pc->dst] = (int)((unsigned)slot[pc->src1] * (unsigned)slot[pc->src2]);
+        NEXT();
+    div:
+        slot[pc->dst] = slot[pc->src1] / slot[pc->src2];
+        NEXT();
+    rem:
+        slot[pc->dst] = slot[pc->src1] % slot[pc->src2];
+        NEXT();
+    store:
+        memcpy(mem + pc->dst, &slot[pc->src1], sizeof(int));
+        NEXT();
+    load:
+        memcpy(&slot[pc->dst], mem + pc->src1, sizeof(int));
+        NEXT();
+#undef NEXT
+    halt:
+        return nullptr;
+    }
+};
+
+// Translates a program into x86-64 code in an mmap'd buffer. The generated function gets
+// the register block in rdi and MEM in rsi; div and rem test for a zero divisor and for
+// INT_MIN / -1 first and return 1 instead of trapping. Elsewhere load() always fails and
+// the caller falls back to an interpreter.
+class JitProgram {
+  public:
+    JitProgram() : code(nullptr), size(0) {
+    }
+    JitProgram(const JitProgram &) = delete;
+    JitProgram &operator=(const JitProgram &) = delete;
+    ~JitProgram() {
+#ifdef ASMC_JIT
+        if (code != nullptr)
+            munmap(code, size);
+#endif
+    }
+    // Return false if the program cannot be compiled.
+    bool load(const vector<ASM> &list) {
+#ifdef ASMC_JIT
+        vector<unsigned char> buf;
+        vector<size_t> traps;  // rel32 fields of the jumps to the trap exit
+        for (const auto &i : list) {
+            if (i.inst == Inst::CE)  // Nothing after it runs.
+                break;
+            for (const auto &op : i.op)
+                if (op.type != Data::INVALID && (op.val < 0 || (op.type != Data::VAL && op.val >= 256)))
+                    return false;
+            switch (i.inst) {
+            case Inst::ADD:
+            case Inst::SUB:
+            case Inst::MUL:
+                load_eax(buf, i.op[1]);
+                if (i.op[2].type == Data::REG) {  // op eax, [rdi + 4 * r]
+                    if (i.inst == Inst::MUL)
+                        emit(buf, {0x0F, 0xAF, 0x87});
+                    else
+                        emit(buf, {(unsigned char)(i.inst == Inst::ADD ? 0x03 : 0x2B), 0x87});
+                    emit32(buf, i.op[2].val * 4);
+                } else {  // op eax, imm32
+                    if (i.inst == Inst::MUL)
+                        emit(buf, {0x69, 0xC0});
+                    else
+                        emit(buf, {(unsigned char)(i.inst == Inst::ADD ? 0x05 : 0x2D)});
+                    emit32(buf, i.op[2].val);
+                }
+                store_reg(buf, 0x87, i.op[0].val);  // mov [rdi + 4 * d], eax
+                break;
+            case Inst::DIV:
+            case Inst::REM:
+                load_eax(buf, i.op[1]);
+                if (i.op[2].type == Data::REG) {  // mov ecx, [rdi + 4 * r]
+                    emit(buf, {0x8B, 0x8F});
+                    emit32(buf, i.op[2].val * 4);
+                } else {  // mov ecx, imm32
+                    emit(buf, {0xB9});
+                    emit32(buf, i.op[2].val);
+                }
+                emit(buf, {0x85, 0xC9, 0x0F, 0x84});  // test ecx, ecx; jz trap
+                traps.push_back(buf.size());
+                emit32(buf, 0);
+                emit(buf, {0x83, 0xF9, 0xFF, 0x75, 0x0B, 0x3D});  // cmp ecx, -1; jne +11; cmp eax, INT_MIN
+                emit32(buf, INT_MIN);
+                emit(buf, {0x0F, 0x84});  // je trap
+                traps.push_back(buf.size());
+                emit32(buf, 0);
+                emit(buf, {0x99, 0xF7, 0xF9});  // cdq; idiv ecx
+                store_reg(buf, i.inst == Inst::DIV ? 0x87 : 0x97, i.op[0].val);  // mov [rdi + 4 * d], eax/edx
+                break;
+            case Inst::LOAD:
+                emit(buf, {0x8B, 0x86});  // mov eax, [rsi + a]
+                emit32(buf, i.op[1].val);
+                store_reg(buf, 0x87, i.op[0].val);
+                break;
+            case Inst::STORE:
+                load_eax(buf, i.op[1]);
+                emit(buf, {0x89, 0x86});  // mov [rsi + a], eax
+                emit32(buf, i.op[0].val);
+                break;
+            default:
+                return false;
+            }
+        }
+        emit(buf, {0x31, 0xC0, 0xC3});  // xor eax, eax; ret
+        for (size_t pos : traps) {
+            int rel = (int)(buf.size() - (pos + 4));
+            memcpy(&buf[pos], &rel, sizeof(int));
+        }
+        emit(buf, {0xB8, 0x01, 0x00, 0x00, 0x00, 0xC3});  // mov eax, 1; ret
+        size = buf.size();
+        void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return false;
+        memcpy(mem, buf.data(), size);
+        if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(mem, size);
+            return false;
+        }
+        code = (unsigned char *)mem;
+        return true;
+#else
+        (void)list;
+        return false;
+#endif
+    }
+    // Return false if a div or rem would trap.
+    bool run(const vector<int> &xyz, tuple<int, int, int> &res) const {
+        int reg[REG::MAX] = {0}, val[3];
+        char mem[MEM::PADDED] = {0};
+        if (code == nullptr)
+            return false;
+        for (int i = 0; i < (int)xyz.size(); i++)
+            memcpy(mem + i * 4, &xyz[i], sizeof(int));
+        if (((int (*)(int *, char *))code)(reg, mem) != 0)
+            return false;
+        for (int i = 0; i < 3; i++)
+            memcpy(&val[i], mem + i * 4, sizeof(int));
+        res = make_tuple(val[0], val[1], val[2]);
+        return true;
+    }
+
+  private:
+    unsigned char *code;
+    size_t size;
+
+    static void emit(vector<unsigned char> &buf, initializer_list<unsigned char> bytes) {
+        buf.insert(buf.end(), bytes);
+    }
+    static void emit32(vector<unsigned char> &buf, int val) {
+        unsigned char bytes[4];
+        memcpy(bytes, &val, sizeof(int));
+        buf.insert(buf.end(), bytes, bytes + 4);
+    }
+    // mov eax, [rdi + 4 * r] or mov eax, imm32
+    static void load_eax(vector<unsigned char> &buf, const ASM::Operand &op) {
+        if (op.type == Data::REG) {
+            emit(buf, {0x8B, 0x87});
+            emit32(buf, op.val * 4);
+        } else {
+            emit(buf, {0xB8});
+            emit32(buf, op.val);
+        }
+    }
+    // mov [rdi + 4 * r], eax (modrm 0x87) or edx (modrm 0x97)
+    static void store_reg(vector<unsigned char> &buf, unsigned char modrm, int r) {
+        emit(buf, {0x89, modrm});
+        emit32(buf, r * 4);
+    }
+};
+
+#ifdef ASMC_SIMD
+// Return how many leading lanes were computed; the caller finishes the rest.
+__attribute__((target("avx2"))) static int lanes_arith_avx2(Inst inst, int *dst, const int *a, const int *b, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i)), y = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i r = inst == Inst::ADD   ? _mm256_add_epi32(x, y)
+                    : inst == Inst::SUB ? _mm256_sub_epi32(x, y)
+                                        : _mm256_mullo_epi32(x, y);
+        _mm256_storeu_si256((__m256i *)(dst + i), r);
+    }
+    return i;
+}
+__attribute__((target("sse4.1"))) static int lanes_arith_sse(Inst inst, int *dst, const int *a, const int *b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i)), y = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i r = inst == Inst::ADD ? _mm_add_epi32(x, y) : inst == Inst::SUB ? _mm_sub_epi32(x, y) : _mm_mullo_epi32(x, y);
+        _mm_storeu_si128((__m128i *)(dst + i), r);
+    }
+    return i;
+}
+#endif
+
+// dst[i] = a[i] op b[i] for add, sub and mul, using the widest vector unit the CPU has.
+static void lanes_arith(Inst inst, int *dst, const int *a, const int *b, int n) {
+    int i = 0;
+#ifdef ASMC_SIMD
+    static const int level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("sse4.1") ? 1 : 0;
+    if (level == 2)
+        i = lanes_arith_avx2(inst, dst, a, b, n);
+    else if (level == 1)
+        i = lanes_arith_sse(inst, dst, a, b, n);
+#endif
+    for (; i < n; i++) {
+        unsigned x = a[i], y = b[i];
+        dst[i] = (int)(inst == Inst::ADD ? x + y : inst == Inst::SUB ? x - y : x * y);
+    }
+}
+
+// Runs one program over many (x, y, z) inputs at once. Registers, memory words and
+// immediates each get a row of LANES values (struct of arrays), so every instruction is one
+// pass over contiguous rows: add/sub/mul are vectorized, load/store are row copies and
+// div/rem check each lane for a zero divisor instead of trapping.
+class BatchProgram {
+  public:
+    static const int LANES = 1024;
+    enum Fault { OK = 0, DIV_BY_ZERO = 1, DIV_OVERFLOW = 2 };
+
+    // Return false if the program cannot be split into lanes (a memory access that is not
+    // 4-byte aligned overlaps two words).
+    bool load(const vector<ASM> &list) {
+        int reg_slot[REG::MAX], mem_slot[MEM::MAX];
+        vector<int> imm;
+        memset(reg_slot, -1, sizeof(reg_slot));
+        memset(mem_slot, -1, sizeof(mem_slot));
+        nslots = 0;
+        for (int i = 0; i < 3; i++)  // x, y and z are always read back.
+            mem_slot[i * 4] = nslots++;
+        code.clear();
+        for (const auto &i : list) {
+            if (i.inst == Inst::CE)
+                break;
+            Step step = {i.inst, {0, 0, 0}};
+            for (int idx = 0; idx < 3; idx++) {
+                const ASM::Operand &op = i.op[idx];
+                if (op.type == Data::INVALID)
+                    continue;
+                if (op.val < 0 || (op.type != Data::VAL && op.val >= 256) || (op.type == Data::MEM && op.val % 4))
+                    return false;
+                if (op.type == Data::VAL) {
+                    step.slot[idx] = -1 - (int)imm.size();  // Renumbered below.
+                    imm.push_back(op.val);
+                    continue;
+                }
+                int &slot = op.type == Data::REG ? reg_slot[op.val] : mem_slot[op.val];
+                if (slot == -1)
+                    slot = nslots++;
+                step.slot[idx] = slot;
+            }
+            code.push_back(step);
+        }
+        nvars = nslots;
+        for (auto &step : code)
+            for (int &slot : step.slot)
+                if (slot < 0)
+                    slot = nvars - 1 - slot;
+        nslots = nvars + (int)imm.size();
+        data.assign((size_t)nslots * LANES, 0);
+        for (int i = 0; i < (int)imm.size(); i++)
+            fill(row(nvars + i), row(nvars + i) + LANES, imm[i]);
+        return true;
+    }
+    // xyz holds count triples; out receives count final triples and fault one Fault per input.
+    void run(const int *xyz, int count, int *out, unsigned char *fault) {
+        for (int base = 0; base < count; base += LANES) {
+            int n = count - base < LANES ? count - base : LANES;
+            memset(data.data(), 0, (size_t)nvars * LANES * sizeof(int));
+            memset(fault + base, OK, n);
+            for (int v = 0; v < 3; v++)
+                for (int l = 0; l < n; l++)
+                    row(v)[l] = xyz[(base + l) * 3 + v];
+            for (const auto &step : code) {
+                int *dst = row(step.slot[0]);
+                const int *a = row(step.slot[1]), *b = row(step.slot[2]);
+                switch (step.inst) {
+                case Inst::ADD:
+                case Inst::SUB:
+                case Inst::MUL:
+                    lanes_arith(step.inst, dst, a, b, n);
+                    break;
+                case Inst::DIV:
+                case Inst::REM:
+                    for (int l = 0; l < n; l++) {
+                        if (b[l] == 0 || (a[l] == INT_MIN && b[l] == -1)) {
+                            fault[base + l] |= b[l] == 0 ? DIV_BY_ZERO : DIV_OVERFLOW;
+                            dst[l] = 0;
+                        } else
+                            dst[l] = step.inst == Inst::DIV ? a[l] / b[l] : a[l] % b[l];
+                    }
+                    break;
+                case Inst::STORE:
+                case Inst::LOAD:
+                    memmove(dst, a, n * sizeof(int));
+                    break;
+                default:
+                    break;
+                }
+            }
+            for (int v = 0; v < 3; v++)
+                for (int l = 0; l < n; l++)
+                    out[(base + l) * 3 + v] = row(v)[l];
+        }
+    }
+
+  private:
+    struct Step {
+        Inst inst;
+        int slot[3];  // Rows of the destination and both sources.
+    };
+    vector<Step> code;
+    vector<int> data;
+    int nslots, nvars;  // Rows [0, nvars) are reset for every batch; the immediates follow.
+
+    int *row(int slot) {
+        return data.data() + (size_t)slot * LANES;
+    }
+};
+
+// How the -b and -c reports describe a BatchProgram::Fault other than OK.
+const char *fault_name(unsigned char fault) {
+    return fault & BatchProgram::DIV_BY_ZERO ? "division by zero" : "division overflow";
+}
+
+// Return -1 for a "CE" instruction.
+int cost(const ASM &i) {
     const static map<Inst, int> cost = {{Inst::ADD, 10}, {Inst::SUB, 10},    {Inst::MUL, 30},  {Inst::DIV, 50},
                                         {Inst::REM, 60}, {Inst::STORE, 200}, {Inst::LOAD, 200}};
-    int cycle = 0, tmp;
+    int penalty = 0;
+    switch (i.inst) {
+    case Inst::ADD:
+    case Inst::SUB:
+    case Inst::MUL:
+    case Inst::DIV:
+    case Inst::REM:
+    case Inst::STORE:
+    case Inst::LOAD:
+        for (const auto &op : i.op)
+            if (op.type == Data::REG && op.val >= 8)
+                penalty = 1;
+        return cost.at(i.inst) * (1 + penalty);
+    case Inst::CE:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+// Return -1 if there exists a "CE" instruction.
+int cycle(const vector<ASM> &list) {
+    int cycle = 0;
     for (const auto &i : list) {
-        int penalty = 0;
+        int tmp = cost(i);
+        if (tmp == -1)
+            return -1;
+        cycle += tmp;
+    }
+    return cycle;
+}
+
+// Executes each instruction as soon as it is read and keeps only the machine state and the
+// running cycle total, so "print" costs O(1) and memory does not grow with the program.
+struct StreamMachine {
+    int reg[REG::MAX];
+    char mem[MEM::PADDED];
+    int cycles;
+    bool ce;
+    unsigned char fault;  // A BatchProgram::Fault; once a div or rem traps the state is meaningless.
+    StreamMachine(const vector<int> &xyz) : cycles(0), ce(false), fault(BatchProgram::OK) {
+        memset(reg, 0, sizeof(reg));
+        memset(mem, 0, sizeof(mem));
+        for (int i = 0; i < (int)xyz.size(); i++)
+            memcpy(mem + i * 4, &xyz[i], sizeof(int));
+    }
+    void step(const ASM &i) {
+        int val[3] = {0, 0, 0}, tmp = ce ? 0 : cost(i);
+        if (tmp == -1)  // Like evaluate(), nothing after a CE runs.
+            ce = true;
+        if (ce)
+            return;
+        cycles += tmp;
+        if (fault)
+            return;
+        for (int idx = 0; idx < 3; idx++) {
+            if (i.op[idx].type == Data::REG)
+                val[idx] = reg[i.op[idx].val];
+            else if (i.op[idx].type == Data::MEM)
+                memcpy(&val[idx], mem + i.op[idx].val, sizeof(int));
+            else
+                val[idx] = i.op[idx].val;
+        }
+        if ((i.inst == Inst::DIV || i.inst == Inst::REM) && (val[2] == 0 || (val[1] == INT_MIN && val[2] == -1))) {
+            fault = val[2] == 0 ? BatchProgram::DIV_BY_ZERO : BatchProgram::DIV_OVERFLOW;
+            return;
+        }
         switch (i.inst) {
         case Inst::ADD:
+            reg[i.op[0].val] = (int)((unsigned)val[1] + (unsigned)val[2]);
+            break;
         case Inst::SUB:
+            reg[i.op[0].val] = (int)((unsigned)val[1] - (unsigned)val[2]);
+            break;
         case Inst::MUL:
+            reg[i.op[0].val] = (int)((unsigned)val[1] * (unsigned)val[2]);
+            break;
         case Inst::DIV:
+            reg[i.op[0].val] = val[1] / val[2];
+            break;
         case Inst::REM:
+            reg[i.op[0].val] = val[1] % val[2];
+            break;
         case Inst::STORE:
+            memcpy(mem + i.op[0].val, &val[1], sizeof(int));
+            break;
         case Inst::LOAD:
-            tmp = cost.at(i.inst);
-            for (const auto &op : i.op)
-                if (op.type == Data::REG && op.val >= 8)
-                    penalty = 1;
+            reg[i.op[0].val] = val[1];
             break;
-        case Inst::CE:
-            return -1;
         default:
             break;
         }
-        cycle += tmp * (1 + penalty);
     }
-    return cycle;
+    void report() const {
+        int val[3];
+        if (ce) {
+            puts("CE instruction found.");
+            return;
+        }
+        if (fault) {
+            puts("Division by zero.");
+            return;
+        }
+        for (int i = 0; i < 3; i++)
+            memcpy(&val[i], mem + i * 4, sizeof(int));
+        printf("x, y, z = %d, %d, %d\nTotal cycle = %d\n", val[0], val[1], val[2], cycles);
+    }
+};
+
+// For programs BatchProgram cannot split into lanes: run each of the count inputs on its own
+// StreamMachine and fill out and fault the same way BatchProgram::run does.
+void run_scalar(const vector<ASM> &list, const int *xyz, int count, int *out, unsigned char *fault) {
+    for (int k = 0; k < count; k++) {
+        StreamMachine machine(vector<int>(xyz + k * 3, xyz + k * 3 + 3));
+        for (const auto &i : list) {
+            if (machine.ce || machine.fault)
+                break;
+            machine.step(i);
+        }
+        fault[k] = machine.fault;
+        for (int v = 0; v < 3; v++)
+            memcpy(&out[k * 3 + v], machine.mem + v * 4, sizeof(int));
+    }
+}
+
+// Return false if the file cannot be opened. Lines in the format printed by main -r or
+// ASMC are read as "x, y, z = a, b, c"; anything else is split into integers.
+bool read_triples(const char *path, vector<int> &res, vector<bool> *known = nullptr) {
+    FILE *file = fopen(path, "r");
+    char line[MAX_LENGTH];
+    int v[3];
+    if (file == nullptr) {
+        perror(path);
+        return false;
+    }
+    while (fgets(line, MAX_LENGTH, file) != nullptr) {
+        if (sscanf(line, "x, y, z = %d, %d, %d", &v[0], &v[1], &v[2]) != 3 &&
+            sscanf(line, "%d %d %d", &v[0], &v[1], &v[2]) != 3) {
+            if (known == nullptr || strncmp(line, "Undefined behavior", 18))
+                continue;
+            v[0] = v[1] = v[2] = 0;  // main -r could not give a result for this input.
+            known->push_back(false);
+        } else if (known != nullptr)
+            known->push_back(true);
+        res.insert(res.end(), v, v + 3);
+    }
+    fclose(file);
+    return true;
+}
+
+// Run task(0) ... task(count - 1) on every core. Each worker owns a deque of task indices:
+// it takes its own work from the back and steals from the front of the others' deques when
+// it runs dry. No task is added after the start, so finding every deque empty means done.
+void run_parallel(int count, const function<void(int)> &task) {
+    int nthreads = max(1, (int)thread::hardware_concurrency());
+    vector<deque<int>> queues(nthreads);
+    vector<mutex> locks(nthreads);
+    vector<thread> workers;
+    for (int i = 0; i < count; i++)
+        queues[i % nthreads].push_back(i);
+    for (int w = 0; w < nthreads; w++)
+        workers.emplace_back([&, w]() {
+            while (true) {
+                int job = -1;
+                for (int k = 0; job == -1 && k < nthreads; k++) {
+                    int victim = (w + k) % nthreads;
+                    lock_guard<mutex> guard(locks[victim]);
+                    if (queues[victim].empty())
+                        continue;
+                    if (k == 0) {
+                        job = queues[victim].back();
+                        queues[victim].pop_back();
+                    } else {
+                        job = queues[victim].front();
+                        queues[victim].pop_front();
+                    }
+                }
+                if (job == -1)
+                    return;
+                task(job);
+            }
+        });
+    for (auto &worker : workers)
+        worker.join();
+}
+
+struct CorpusResult {
+    string path;
+    const char *status;  // "ok", "ce", "invalid" or "unreadable"
+    int line, cycle;     // line is the first invalid line
+    vector<int> out;
+    vector<unsigned char> fault;
+};
+
+// Parse and run one listing on every input. Nothing here touches global state, so listings
+// can be processed concurrently.
+void run_listing(CorpusResult &res, const vector<int> &xyz) {
+    FILE *file = fopen(res.path.c_str(), "rb");
+    vector<char> buf;
+    vector<ASM> list;
+    BatchProgram program;
+    res.line = res.cycle = 0;
+    res.status = "unreadable";
+    if (file == nullptr)
+        return;
+    char chunk[1 << 16];
+    for (size_t len; (len = fread(chunk, 1, sizeof(chunk), file)) > 0;)
+        buf.insert(buf.end(), chunk, chunk + len);
+    fclose(file);
+    res.status = "invalid";
+    for (const char *p = buf.data(), *end = p + buf.size(); p != end;) {
+        const char *nl = (const char *)memchr(p, '\n', end - p), *line_end = nl != nullptr ? nl : end;
+        res.line++;
+        if (line_end - p == 3 && !memcmp(p, "end", 3))
+            break;
+        if (!(line_end - p == 5 && !memcmp(p, "print", 5)) && !insert_ASM(p, line_end, list))
+            return;
+        p = nl != nullptr ? nl + 1 : end;
+    }
+    res.line = 0;
+    res.cycle = cycle(list);
+    res.status = "ce";
+    if (res.cycle == -1)
+        return;
+    res.status = "ok";
+    res.out.resize(xyz.size());
+    res.fault.resize(xyz.size() / 3);
+    if (program.load(list))
+        program.run(xyz.data(), (int)xyz.size() / 3, res.out.data(), res.fault.data());
+    else
+        run_scalar(list, xyz.data(), (int)xyz.size() / 3, res.out.data(), res.fault.data());
+}
+
+// Return false if the directory or manifest cannot be read. A directory contributes its
+// *.asm files; any other file is a manifest with one path per line.
+bool list_corpus(const char *path, vector<string> &files) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        perror(path);
+        return false;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        if (dir == nullptr) {
+            perror(path);
+            return false;
+        }
+        for (dirent *entry; (entry = readdir(dir)) != nullptr;) {
+            string name = entry->d_name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".asm") == 0)
+                files.push_back(string(path) + "/" + name);
+        }
+        closedir(dir);
+        sort(files.begin(), files.end());
+        return true;
+    }
+    FILE *file = fopen(path, "r");
+    char line[4096];
+    if (file == nullptr) {
+        perror(path);
+        return false;
+    }
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0')
+            files.push_back(line);
+    }
+    fclose(file);
+    return true;
+}
+
+void print_json_string(FILE *out, const string &str) {
+    fputc('"', out);
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+// ./ASMC -c corpus [inputs] [report]: run every listing of the corpus on every input triple
+// (default 2 3 5) and write one report, CSV if its name ends in ".csv" and JSON otherwise.
+int run_corpus(int argc, char **argv) {
+    vector<string> files;
+    vector<int> xyz = {2, 3, 5};
+    if (argc < 3 || !list_corpus(argv[2], files))
+        return 1;
+    if (argc > 3) {
+        xyz.clear();
+        if (!read_triples(argv[3], xyz))
+            return 1;
+    }
+    FILE *out = argc > 4 ? fopen(argv[4], "w") : stdout;
+    if (out == nullptr) {
+        perror(argv[4]);
+        return 1;
+    }
+    bool csv = argc > 4 && strlen(argv[4]) > 4 && !strcmp(argv[4] + strlen(argv[4]) - 4, ".csv");
+    vector<CorpusResult> results(files.size());
+    for (size_t i = 0; i < files.size(); i++)
+        results[i].path = files[i];
+    run_parallel((int)files.size(), [&](int i) { run_listing(results[i], xyz); });
+    if (csv)
+        fputs("file,status,line,cycle,x_in,y_in,z_in,x,y,z,fault\n", out);
+    else
+        fputs("[\n", out);
+    for (size_t i = 0; i < results.size(); i++) {
+        const CorpusResult &res = results[i];
+        if (csv) {
+            string path = res.path;
+            for (size_t pos = 0; (pos = path.find('"', pos)) != string::npos; pos += 2)
+                path.insert(pos, 1, '"');
+            for (size_t k = 0; k < max((size_t)1, res.fault.size()); k++) {
+                fprintf(out, "\"%s\",%s,%d,%d", path.c_str(), res.status, res.line, res.cycle);
+                if (k < res.fault.size() && res.fault[k])  // The state after a trap is meaningless.
+                    fprintf(out, ",%d,%d,%d,,,,%s\n", xyz[k * 3], xyz[k * 3 + 1], xyz[k * 3 + 2], fault_name(res.fault[k]));
+                else if (k < res.fault.size())
+                    fprintf(out, ",%d,%d,%d,%d,%d,%d,\n", xyz[k * 3], xyz[k * 3 + 1], xyz[k * 3 + 2], res.out[k * 3],
+                            res.out[k * 3 + 1], res.out[k * 3 + 2]);
+                else
+                    fputs(",,,,,,,\n", out);
+            }
+            continue;
+        }
+        fputs("  {\"file\": ", out);
+        print_json_string(out, res.path);
+        fprintf(out, ", \"status\": \"%s\", \"line\": %d, \"cycle\": %d, \"results\": [", res.status, res.line,
+                res.cycle);
+        for (size_t k = 0; k < res.fault.size(); k++) {
+            fprintf(out, "%s{\"input\": [%d, %d, %d], ", k ? ", " : "", xyz[k * 3], xyz[k * 3 + 1], xyz[k * 3 + 2]);
+            if (res.fault[k])
+                fprintf(out, "\"fault\": \"%s\"}", fault_name(res.fault[k]));
+            else
+                fprintf(out, "\"output\": [%d, %d, %d]}", res.out[k * 3], res.out[k * 3 + 1], res.out[k * 3 + 2]);
+        }
+        fprintf(out, "]}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    if (!csv)
+        fputs("]\n", out);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
+
+// ./ASMC -s [x y z]: the same commands as the default mode, run by a StreamMachine.
+int run_stream(const vector<int> &init) {
+    StreamMachine machine(init);
+    LineReader reader;
+    const char *str, *str_end;
+    int lines = 1;
+    while (reader.next(str, str_end)) {
+        if (str_end - str == 5 && !memcmp(str, "print", 5)) {
+            machine.report();
+            continue;
+        }
+        if (str_end - str == 3 && !memcmp(str, "end", 3))
+            break;
+        const char *p = str;
+        while (p != str_end && *p == ' ')
+            p++;
+        if (p != str_end) {
+            ASM line(str, str_end);
+            if (line.inst == Inst::INVALID) {
+                printf("Instruction invalid at line: %d.\n", lines);
+                return 0;
+            }
+            machine.step(line);
+        }
+        lines++;
+    }
+    machine.report();
+    return 0;
+}
+
+void report(const vector<int> &init) {
+    JitProgram jit;
+    ThreadedProgram program;
+    tuple<int, int, int> ans;
+    int C = cycle(asm_list);
+    if (C == -1) {
+        puts("CE instruction found.");
+        return;
+    }
+    if (!jit.load(asm_list) || !jit.run(init, ans))
+        ans = program.load(asm_list) ? program.run(init) : evaluate(asm_list, init);
+    printf("x, y, z = %d, %d, %d\nTotal cycle = %d\n", get<0>(ans), get<1>(ans), get<2>(ans), C);
+}
+
+string format_ASM(const ASM &i) {
+    string res;
+    if (i.inst == Inst::CE)
+        return "Compile Error!";
+    res = inst_names[(int)i.inst];
+    for (const auto &op : i.op) {
+        if (op.type == Data::REG)
+            res += " r" + to_string(op.val);
+        else if (op.type == Data::MEM)
+            res += " [" + to_string(op.val) + "]";
+        else if (op.type == Data::VAL)
+            res += " " + to_string(op.val);
+    }
+    return res;
+}
+
+// ./ASMC -p [N]: print every instruction with its cost and whether the r8+ penalty doubled
+// it, then the totals per opcode, the penalty cycles per register and the N (default 10)
+// most expensive lines.
+void report_profile(int top) {
+    const int ops = (int)Inst::CE;
+    int count[ops] = {0}, total[ops] = {0}, extra[ops] = {0}, reg_extra[REG::MAX] = {0};
+    vector<int> order;
+    int C = cycle(asm_list);
+    if (C == -1) {
+        puts("CE instruction found.");
+        return;
+    }
+    puts(" line  cycles  r8+  instruction");
+    for (int k = 0; k < (int)asm_list.size(); k++) {
+        const ASM &i = asm_list[k];
+        int c = cost(i), base = c;
+        bool penalty = false;
+        for (const auto &op : i.op)
+            if (op.type == Data::REG && op.val >= 8)
+                penalty = true;
+        if (penalty) {
+            base = c / 2;
+            for (int idx = 0; idx < 3; idx++) {  // Every distinct r8+ register of the line is charged once.
+                const ASM::Operand &op = i.op[idx];
+                bool seen = false;
+                for (int prev = 0; prev < idx; prev++)
+                    seen |= i.op[prev].type == Data::REG && i.op[prev].val == op.val;
+                if (op.type == Data::REG && op.val >= 8 && !seen)
+                    reg_extra[op.val] += base;
+            }
+        }
+        count[(int)i.inst]++;
+        total[(int)i.inst] += c;
+        extra[(int)i.inst] += c - base;
+        order.push_back(k);
+        printf("%5d  %6d  %3s  %s\n", asm_lines[k], c, penalty ? "*" : "", format_ASM(i).c_str());
+    }
+    puts("\nopcode  count  cycles  penalty");
+    for (int op = 0; op < ops; op++)
+        if (count[op])
+            printf("%-6s  %5d  %6d  %7d\n", inst_names[op], count[op], total[op], extra[op]);
+    puts("\nregister  penalty");
+    for (int r = 8; r < REG::MAX; r++)
+        if (reg_extra[r])
+            printf("r%-7d  %7d\n", r, reg_extra[r]);
+    stable_sort(order.begin(), order.end(), [](int a, int b) { return cost(asm_list[a]) > cost(asm_list[b]); });
+    printf("\ntop %d lines\n", top);
+    for (int k = 0; k < top && k < (int)order.size(); k++)
+        printf("%5d  %6d  %s\n", asm_lines[order[k]], cost(asm_list[order[k]]), format_ASM(asm_list[order[k]]).c_str());
+    printf("\nTotal cycle = %d\n", C);
+}
+
+// ./ASMC -b inputs [expected]: run the program on every triple in inputs. Without expected
+// each result is printed; with it only the inputs whose results differ are.
+void report_batch(const char *inputs, const char *expected) {
+    BatchProgram program;
+    vector<int> xyz, want;
+    vector<bool> known;
+    int C = cycle(asm_list);
+    if (C == -1) {
+        puts("CE instruction found.");
+        return;
+    }
+    if (!read_triples(inputs, xyz) || (expected != nullptr && !read_triples(expected, want, &known)))
+        return;
+    int count = (int)xyz.size() / 3, mismatches = 0;
+    vector<int> out(xyz.size());
+    vector<unsigned char> fault(count);
+    if (program.load(asm_list))
+        program.run(xyz.data(), count, out.data(), fault.data());
+    else
+        run_scalar(asm_list, xyz.data(), count, out.data(), fault.data());
+    for (int i = 0; i < count; i++) {
+        const int *got = &out[i * 3], *in = &xyz[i * 3];
+        if (expected != nullptr && i < (int)known.size() &&
+            (!known[i] || (fault[i] == BatchProgram::OK && equal(got, got + 3, &want[i * 3]))))
+            continue;  // Inputs with undefined behavior in C have no expected result to compare against.
+        if (expected != nullptr) {
+            mismatches++;
+            printf("%d %d %d: ", in[0], in[1], in[2]);
+        }
+        if (fault[i] != BatchProgram::OK)
+            puts(fault_name(fault[i]));
+        else if (expected != nullptr && i < (int)known.size())
+            printf("x, y, z = %d, %d, %d, expected %d, %d, %d\n", got[0], got[1], got[2], want[i * 3],
+                   want[i * 3 + 1], want[i * 3 + 2]);
+        else
+            printf("x, y, z = %d, %d, %d\n", got[0], got[1], got[2]);
+    }
+    if (expected != nullptr)
+        printf("%d of %d inputs match.\n", count - mismatches, count);
+    printf("Total cycle = %d\n", C);
 }
 
 // ./ASMC x y z
+// ./ASMC -b inputs [expected]
+// ./ASMC -c corpus [inputs] [report]
+// ./ASMC -s [x y z]
+// ./ASMC -p [N]
 int main(int argc, char **argv) {
     vector<int> init;
-    if (argc == 4)
+    if (argc >= 2 && !strcmp(argv[1], "-c"))
+        return run_corpus(argc, argv);
+    if (argc >= 2 && !strcmp(argv[1], "-s")) {
+        init = {2, 3, 5};
+        for (int i = 2; argc == 5 && i < argc; i++)
+            init[i - 2] = atoi(argv[i]);
+        return run_stream(init);
+    }
+    const char *batch_inputs = nullptr, *batch_expected = nullptr;
+    int profile = 0;
+    if (argc >= 2 && !strcmp(argv[1], "-p")) {
+        profile = argc > 2 ? atoi(argv[2]) : 10;
+        if (profile < 1) {
+            fputs("usage: ASMC -p [N] < program, with N >= 1\n", stderr);
+            return 1;
+        }
+    } else if (argc >= 3 && !strcmp(argv[1], "-b")) {
+        batch_inputs = argv[2];
+        batch_expected = argc > 3 ? argv[3] : nullptr;
+    } else if (argc == 4)
         for (int i = 1; i < argc; i++)
             init.emplace_back(atoi(argv[i]));
     else
         init = {2, 3, 5};
-    string str;
+    auto output = [&]() {
+        if (batch_inputs != nullptr)
+            report_batch(batch_inputs, batch_expected);
+        else if (profile != 0)
+            report_profile(profile);
+        else
+            report(init);
+    };
+    LineReader reader;
+    const char *str, *str_end;
     int lines = 1;
-    while (getline(cin, str)) {
-        if (str == "print") {
-            auto ans = evaluate(asm_list, init);
-            int C = cycle(asm_list);
-            if (C != -1)
-                printf("x, y, z = %d, %d, %d\nTotal cycle = %d\n", get<0>(ans), get<1>(ans), get<2>(ans), C);
-            else
-                puts("CE instruction found.");
+    while (reader.next(str, str_end)) {
+        if (str_end - str == 5 && !memcmp(str, "print", 5)) {
+            output();
             continue;
         }
-        if (str == "end") {
-            auto ans = evaluate(asm_list, init);
-            int C = cycle(asm_list);
-            if (C != -1)
-                printf("x, y, z = %d, %d, %d\nTotal cycle = %d\n", get<0>(ans), get<1>(ans), get<2>(ans), C);
-            else
-                puts("CE instruction found.");
+        if (str_end - str == 3 && !memcmp(str, "end", 3)) {
+            output();
             return 0;
         }
-        if (!insert_ASM(str)) {
+        if (!insert_ASM(str, str_end)) {
             printf("Instruction invalid at line: %d.\n", lines);
             return 0;
         }
+        asm_lines.resize(asm_list.size(), lines);
         lines++;
     }
-    auto ans = evaluate(asm_list, init);
-    int C = cycle(asm_list);
-    if (C != -1)
-        printf("x, y, z = %d, %d, %d\nTotal cycle = %d\n", get<0>(ans), get<1>(ans), get<2>(ans), C);
-    else
-        puts("CE instruction found.");
+    output();
     return 0;
 }
@@ -0,0 +1,40 @@
+#!/bin/bash
+# 產生很深的巢狀敘述，量 main 編譯的時間；每個節點的時間 (ns/node) 應該不隨深度變大，也不會把 stack 用完
+# 用法：bench/nesting.sh [最大深度]，預設 1000000
+cd "$(dirname "$0")/.."
+max=${1:-1000000}
+bin=/tmp/nesting_main
+gcc -O2 -w -o $bin main.c || exit 1
+tmp=$(mktemp)
+out=$(mktemp)
+trap 'rm -f $tmp $out' EXIT
+
+# 第一個參數是形狀，第二個是深度；每種形狀深度 n 都會產生大約 n 個節點。
+# negmul 每層都要把負號提出來重新化簡，terms 是 n 個不同的項，horner 每層都是一個新的線性式
+gen() {
+    case $1 in
+        paren) printf 'x = '; printf '%*s' $2 '' | tr ' ' '('; printf 'y'; printf '%*s;\n' $2 '' | tr ' ' ')' ;;
+        minus) printf 'x = '; printf '%*s' $2 '' | sed 's/ /- /g'; printf 'y;\n' ;;
+        incdec) printf 'y = --'; printf '%*s' $2 '' | tr ' ' '('; printf 'y'; printf '%*s;\n' $2 '' | tr ' ' ')' ;;
+        div) printf 'x = '; printf '%*s' $2 '' | tr ' ' '('; printf 'y'; printf '%*s;\n' $2 '' | sed 's| | / z)|g' ;;
+        add) printf 'x = '; printf '%*s' $2 '' | sed 's/ /(y + /g'; printf 'z'; printf '%*s;\n' $2 '' | tr ' ' ')' ;;
+        negmul) printf 'x = '; printf '%*s' $2 '' | sed 's/ /y * -(/g'; printf 'y'; printf '%*s;\n' $2 '' | tr ' ' ')' ;;
+        terms) printf 'x = y'; seq 2 $(($2 + 1)) | sed 's|^| + y / |' | tr -d '\n'; printf ';\n' ;;
+        horner) printf 'x = '; printf '%*s' $2 '' | tr ' ' '('; printf 'z'; printf '%*s;\n' $2 '' | sed 's/ / * z + 1)/g' ;;
+    esac
+}
+
+printf '%-8s %10s %10s %10s\n' shape depth ms ns/node
+for shape in paren minus incdec div add negmul terms horner; do
+    for ((n = 1000; n <= max; n *= 10)); do
+        gen $shape $n > $tmp
+        start=$(date +%s%N)
+        $bin < $tmp > $out || { echo "$shape $n: main failed"; exit 1; }
+        end=$(date +%s%N)
+        if grep -q 'Compile Error' $out; then  # main 編譯錯誤時也是回傳 0
+            echo "$shape $n: Compile Error"
+            exit 1
+        fi
+        printf '%-8s %10d %10d %10d\n' $shape $n $(((end - start) / 1000000)) $(((end - start) / n))
+    done
+done
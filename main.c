@@ -5,8 +5,21 @@
 #include <string.h>
 
 #define NUM_REGISTERS 256
-#define MAX_LENGTH 200
-#define MAX_INSTRUCTIONS 100
+#define MEMORY_SIZE 256
+#define SPILL_BASE 12  // 暫存器不夠時溢出到記憶體的第一個位址，0、4、8 是 x、y、z
+#define READ_CHUNK 65536  // 每次從 stdin 讀進來的位元組數
+#define MAX_CHAIN 4  // 乘法拆成 add/sub 時最多的步數
+#define VALUE_WINDOW 64  // 值編號表最多留著的值；沿用舊值會拉長存活區間，超過就淘汰最久沒用到的
+#define SUPEROPT_MAX_NODES 5     // 超級最佳化只處理運算子不超過這個數量的式子
+#define SUPEROPT_MAX_INPUTS 3
+#define SUPEROPT_MAX_IMM 5
+#define SUPEROPT_MAX_LEN 3       // 搜尋的指令序列長度上限
+#define SUPEROPT_BUDGET 1000000         // 每個式子最多搜尋的節點數
+#define SUPEROPT_TOTAL_BUDGET 50000000  // 整次編譯最多搜尋的節點數，大約一秒；用完之後只查表
+#define SUPEROPT_KEY_LENGTH 128         // 設了環境變數 SUPEROPT_DB 才會把找到的序列存到那個檔案
+#define NUM_VECTORS 4
+#define MAX_TERMS 64
+#define NIL -1  // 空的 AST 節點編號
 typedef enum {
     ASSIGN,
     ADD,
@@ -26,9 +39,6 @@ typedef enum {
     MINUS,
     END
 } Kind;
-typedef struct {
-    char instruction[MAX_LENGTH];
-} Instruction;
 typedef enum {
     STMT,
     EXPR,
@@ -39,25 +49,144 @@ typedef enum {
     POSTFIX_EXPR,
     PRI_EXPR
 } GrammarState;
+typedef struct {
+    int next_assign, next_rpar;  // 從這裡往右，第一個深度等於前一個 token 深度的 '=' / ')'
+    int prev_add, prev_mul;      // 從這裡往左，第一個深度和這裡相同的加減 / 乘除
+} Section;
 typedef struct TokenUnit {
     Kind kind;
     int val;  // 記錄整數值或變量名稱
-    struct TokenUnit* next;
 } Token;
-typedef struct ASTUnit {
+typedef enum {
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_REM,
+    IR_LOAD,
+    IR_STORE,
+    IR_NOP  // 已被刪除，輸出前會移除
+} Opcode;
+typedef enum {
+    MODE_VAL,  // 要子樹的值
+    MODE_NEG   // 要子樹的相反數
+} Mode;
+typedef struct {
+    int cost;            // 這個模式下覆蓋整個子樹的 cycle 估計
+    Mode lmode, rmode;   // 兩邊的子樹要用哪個模式產生
+    Opcode op;
+    bool swap, negate;   // 交換運算元、最後再補一條 sub 0
+} Tile;
+typedef struct {
     Kind kind;
-    int val;  // 記錄整數值或變量名稱
-    struct ASTUnit *lhs, *mid, *rhs;
+    Mode lmode, rmode;
+    Opcode op;
+    bool swap;
+    Mode sign;       // 這條規則算出來的是值還是相反數
+    bool const_rhs;  // 右邊必須是 1 和 INT_MIN 以外的常數，除法的負號才能安全地移動
+} TileRule;
+typedef struct {
+    Kind kind;
+    int val;            // 記錄整數值或變量名稱
+    int lhs, mid, rhs;  // 子節點在 ast[] 中的編號，NIL 表示沒有；子節點一定排在父節點前面
+    int need;           // Sethi-Ullman 標記：算出這個子樹至少要幾個暫存器
+    bool impure;        // 子樹裡有 ++、--、=
+    unsigned hash;      // 子樹結構的雜湊值，一樣的子樹一定相同
+    Tile tile[2];       // 指令選擇的結果，依 Mode 索引
 } AST;
 typedef struct {
     Kind kinds;
     int val;
 } NodeInfo;
 typedef struct {
-    bool in_use;
-    bool changed;
-    Token token;
-} Register;
+    unsigned coef;  // mod 2^32
+    int term;
+    bool impure;  // 有副作用的項不會被合併或刪掉
+    int order;    // 原本的位置
+} LinearTerm;
+typedef struct {
+    LinearTerm* terms;
+    int len, cap;
+    unsigned constant;
+    int* index;     // 沒有副作用的項依 hash 開放定址，存 terms 中的編號，-1 是空位
+    int index_cap;
+} LinearForm;
+typedef enum {
+    OPND_NONE,
+    OPND_REG,  // 虛擬暫存器編號
+    OPND_IMM,  // 非負立即數
+    OPND_MEM   // 記憶體位址
+} OperandKind;
+typedef struct {
+    OperandKind kind;
+    int val;
+} Operand;
+typedef struct {
+    Opcode op;
+    Operand dst, src1, src2;
+    int stmt;  // 來源敘述的編號
+} IRInst;
+typedef struct {
+    Opcode op;
+    Operand src1, src2;
+    int vreg;   // 結果所在的虛擬暫存器，-1 表示空位
+    int stamp;  // 最後一次被放進表或沿用的時間
+} ValueEntry;
+typedef struct {
+    Opcode op;
+    int a, b;  // 運算元在數值表中的編號，乘法拆解時 0 是立即數 0，1 是被乘數，k + 2 是第 k 步的結果
+} ChainStep;
+typedef struct {
+    int len;                   // -1 表示項數太多，無法驗證
+    int mono[MAX_TERMS];       // 每個變數的次數各佔 4 個位元
+    unsigned coef[MAX_TERMS];  // 係數 mod 2^32
+} Poly;
+typedef struct {
+    int nin, nimm;  // 數值表依序是輸入、立即數、每一步的結果
+    unsigned imm[SUPEROPT_MAX_IMM];
+    unsigned val[SUPEROPT_MAX_INPUTS + SUPEROPT_MAX_IMM + SUPEROPT_MAX_LEN][NUM_VECTORS];
+    unsigned target[NUM_VECTORS];
+    Poly goal;
+    ChainStep step[SUPEROPT_MAX_LEN], best[SUPEROPT_MAX_LEN];
+    int best_len, best_cost, budget;
+} SuperSearch;
+typedef struct {
+    char *key, *prog;
+} SuperEntry;
+typedef struct {
+    int def, last_use;  // 定義和最後一次讀取的指令位置
+    int weight;         // 用到這個值的指令的 cycle 總和
+    int *adj, deg, cap;  // 干擾圖上的鄰居
+} LiveRange;
+typedef struct {
+    int l, r;  // 還沒 parse 的範圍
+    GrammarState S;
+    int arity;  // 0 表示要 parse [l, r]；1、2 表示子樹都好了，用 kind 建一個一元或二元節點
+    Kind kind;
+} ParseTask;
+typedef struct {
+    int now, stage;  // stage 是已經化簡好的子節點數
+    int negs;        // 結果外面還要補幾個負號
+    int kid[3];      // 化簡好的 lhs、mid、rhs
+} SimplifyFrame;
+typedef struct {
+    int now, stage;  // stage 是已經正規化好的子節點數，-1 表示正在收集以 now 開頭的 +/- 串
+    int kid[3];
+    LinearForm f;
+    int base;        // 這個線性式還沒收集的部分在 collect_stack 中從這裡開始
+    unsigned coef;   // 正在正規化的那一項的係數
+} NormalizeFrame;
+typedef struct {
+    int now;
+    unsigned scale;
+} CollectItem;
+typedef struct {
+    int now;
+    Mode mode;
+    int stage;       // 已經產生好的子樹數
+    bool rhs_first;  // 先算右邊的子樹
+    Operand first;   // 先算好的那個子樹的結果
+} CodegenFrame;
 
 #define err(x)                                                \
     {                                                         \
@@ -71,164 +200,320 @@ typedef struct {
 
 #define DEBUG 0
 
-Token* lexer(const char* in);
-Token* new_token(Kind kind, int val);
-size_t token_list_to_arr(Token** head);
-AST* parser(Token* arr, size_t len);
-AST* parse(Token* arr, int l, int r, GrammarState S);
-AST* new_AST(Kind kind, int val);
-int findNextSection(Token* arr, int start, int end, int (*cond)(Kind));
+// 讓 arr 至少放得下 n 個元素，容量不夠時加倍
+#define RESERVE(arr, cap, n)                                                    \
+    {                                                                           \
+        if ((n) > (cap)) {                                                      \
+            (cap) = (cap) * 2 > (n) ? (cap) * 2 : (n);                          \
+            (arr) = realloc((arr), sizeof(*(arr)) * (cap));                     \
+        }                                                                       \
+    }
+#define RESIMPLIFY(x) (*again = true, (x))  // simplify_node() 中代替遞迴呼叫 simplify(x)
+
+bool read_statement();
+Token* lexer(const char* in, size_t* len);
+void new_token(Kind kind, int val, size_t* len);
+int parser(Token* arr, size_t len);
+int parse(Token* arr, int l, int r, GrammarState S);
+int new_AST(Kind kind, int val);
+int new_unary(Kind kind, int mid);
+void build_sections(Token* arr, int len);
 int condASSIGN(Kind kind);
 int condADD(Kind kind);
 int condMUL(Kind kind);
 int condRPAR(Kind kind);
-void semantic_check(AST* now);
-int codegen(AST* root);
-void freeAST(AST* now);
+void semantic_check(int first, int root);
+bool eval_arith(Kind kind, int left, int right, int* res);
+void fold_constants(int first, int root);
+void fold_node(int now);
+int child_of(int now, int i);
+int post_order_of(int root);
+bool has_side_effect(int now);
+bool same_expr(int a, int b);
+bool is_const(int now, int val);
+int negate(int now);
+int retag(int now, Kind kind, int lhs, int rhs);
+int strip_minus(int now);
+int simplify(int root);
+int simplify_node(int now, bool* again, int* negs);
+void label_node(int now);
+void grow_linear_index(LinearForm* f);
+void add_linear_term(LinearForm* f, unsigned coef, int term);
+int collect_terms(LinearForm* f, int base, unsigned* coef);
+int new_binary(Kind kind, int lhs, int rhs);
+int cmp_linear_term(const void* a, const void* b);
+int linear_term(LinearTerm* t, unsigned magnitude);
+int rebuild_linear(LinearForm* f);
+int normalize_linear(int root);
+int copy_post_order(int root);
+int relayout(int first, int root);
+int const_value(int val, Mode mode);
+int const_cost(int val);
+int mul_const_cost(int k);
+void select_tiles(int first, int root);
+void select_tile(int now);
+Operand codegen(int root, Mode mode);
+bool interpret(int first, int root, int* var, int* res, const char** ub);
+int run_interpreter(int* roots, int count, int argc, char* argv[]);
 void token_print(Token* in, size_t len);
-void AST_print(AST* head);
+void AST_print(int head);
 int get_register_for_variable(char var);
 void init_registers();
-Register* assign_register(Token token);
-void free_register(int reg_num);
-void print_register();
-int is_constant(AST* root);
-int have_identifier(AST* root);
-int codegen2(AST* root);
-
-char input[MAX_LENGTH];
-Register registers[NUM_REGISTERS];
-int reg[NUM_REGISTERS] = {0};
-
-int main() {
-    Instruction instructions[MAX_INSTRUCTIONS];
-    int instruction_count = 0;
-    for (int i = 0; i < MAX_INSTRUCTIONS; i++)
-        instructions[i].instruction[0] = '\0';
+Operand new_vreg();
+Operand imm(int val);
+Operand mem(int addr);
+void emit(Opcode op, Operand dst, Operand src1, Operand src2);
+unsigned hash_value(Opcode op, Operand src1, Operand src2);
+bool same_operand(Operand a, Operand b);
+ValueEntry* find_value(Opcode op, Operand src1, Operand src2);
+void grow_values();
+void remove_value(ValueEntry* e);
+void evict_values();
+Operand emit_arith(Opcode op, Operand src1, Operand src2);
+Operand to_register(Operand opnd);
+Operand constant_operand(int val);
+Operand load_variable(char var);
+void store_variable(char var, Operand opnd);
+int find_mul_chain(unsigned target, ChainStep* chain);
+bool search_mul_chain(unsigned target, ChainStep* chain, unsigned* val, int depth, int len);
+int mul_chain_extra_registers(ChainStep* chain, int len);
+Operand emit_mul(Operand left, Operand right);
+Operand emit_mul_const(Operand left, int k);
+bool superopt_candidate(int now, int* nodes, char* vars, int* nvars);
+void superopt_key(int now, const char* vars, char* buf, size_t size);
+unsigned superopt_eval(int now, const char* vars, const unsigned* in);
+int superopt_baseline(int now);
+Poly poly_term(unsigned coef, int mono);
+void poly_normalize(Poly* p);
+Poly poly_apply(Opcode op, Poly* a, Poly* b);
+Poly poly_of_ast(int now, const char* vars);
+bool superopt_verify(SuperSearch* s, int len);
+void superopt_search(SuperSearch* s, int depth, int cost);
+void superopt_add_imm(SuperSearch* s, int val);
+void superopt_collect_imm(SuperSearch* s, int now);
+void superopt_encode(SuperSearch* s, char* buf, size_t size);
+unsigned hash_string(const char* str);
+SuperEntry* superopt_find(const char* key);
+void superopt_insert(const char* key, const char* prog);
+void superopt_load();
+void superopt_save(const char* key, const char* prog);
+bool superoptimize(int now, Operand* res);
+void build_live_ranges();
+void add_interference(int a, int b);
+void build_interference_graph();
+int cmp_weight(const void* a, const void* b);
+void remove_dead_stores();
+void remove_dead_code();
+void allocate_registers();
+void spill_registers(int* spilled, int n);
+void assign_spill_slots();
+void print_operand(Operand opnd);
+void print_program();
+void IR_print();
+
+const int op_cost[] = {10, 10, 30, 50, 60, 200, 200};  // 和 ASMC 的 cycle() 相同
+IRInst* ir = NULL;                                     // 整個程式的中間碼
+int ir_len = 0, ir_cap = 0;
+int vreg_count = 0;                                    // 已配置的虛擬暫存器數量
+int* phys = NULL;                                      // 虛擬暫存器 -> 實體暫存器
+bool* no_spill = NULL;                                 // 溢出時產生的短暫值，著色時排在最前面，不會再被溢出
+int no_spill_cap = 0;
+int spill_count = 0;                                   // 溢出用的虛擬記憶體位置，[MEMORY_SIZE + i] 最後才換成真的位址
+ValueEntry* values = NULL;                             // 值編號表，跨敘述共用
+int value_len = 0, value_cap = 0;
+ValueEntry* value_queue = NULL;                        // 值編號表的使用紀錄，由舊到新，淘汰時從 value_head 開始看
+int value_head = 0, value_queue_len = 0, value_queue_cap = 0, value_clock = 0;
+SuperEntry* superopt_table = NULL;                     // 超級最佳化的結果，key 是正規化後的式子
+int superopt_len = 0, superopt_cap = 0;
+bool superopt_loaded = false;
+int superopt_steps = SUPEROPT_TOTAL_BUDGET;            // 這次編譯還能搜尋的節點數
+const unsigned superopt_vectors[NUM_VECTORS][SUPEROPT_MAX_INPUTS] = {
+    {0x2545F491u, 0x9E3779B9u, 0x7u}, {0xFFFFFFF3u, 0x3u, 0x12345u}, {0x5u, 0x80000001u, 0xDEADBEEFu},
+    {0x1000u, 0xB5u, 0xFFFF0001u}};
+LiveRange* live = NULL;                                // 每個虛擬暫存器的存活區間
+int cur_stmt = 0;                                      // 目前正在產生的敘述編號
+int var_vreg[3];                                       // x, y, z 目前的值所在的虛擬暫存器，-1 表示還沒 load 過
+Token* tokens = NULL;                                  // lexer 的輸出，每個敘述重複使用
+size_t token_cap = 0;
+Section* sections = NULL;                              // 每個 token 的分段查詢結果，parse() 用來找要切開的位置
+int* section_last = NULL;
+size_t section_cap = 0;
+char* stmt_text = NULL;                                // 目前的敘述，從 stdin 讀到 ';' 為止，每個敘述重複使用
+size_t stmt_cap = 0;
+int *post_order = NULL, *walk_stack = NULL;            // post_order_of() 的結果和走訪用的堆疊
+int post_order_cap = 0, walk_cap = 0;
+CollectItem* collect_stack = NULL;                     // normalize_linear() 中每個線性式還沒收集的部分
+int collect_len = 0, collect_cap = 0;
+char read_buf[READ_CHUNK];                             // stdin 讀進來還沒用完的部分
+size_t read_pos = 0, read_len = 0;
+AST* ast = NULL;                                       // AST 節點連續存放，編譯完一個敘述就把長度歸零重複使用
+int ast_len = 0, ast_cap = 0;
+int pending_values = 0;                                // codegen 中已算好、還在等著被使用的運算元個數
+// 每條規則是一種把負號吸收進運算的方式；除法和取餘數只在除數是常數時移動負號，避免 INT_MIN 的例外
+const TileRule tile_rules[] = {
+    {ADD, MODE_VAL, MODE_VAL, IR_ADD, false, MODE_VAL, false}, {ADD, MODE_VAL, MODE_NEG, IR_SUB, false, MODE_VAL, false},
+    {ADD, MODE_NEG, MODE_VAL, IR_SUB, true, MODE_VAL, false},  {ADD, MODE_NEG, MODE_NEG, IR_ADD, false, MODE_NEG, false},
+    {ADD, MODE_NEG, MODE_VAL, IR_SUB, false, MODE_NEG, false}, {ADD, MODE_VAL, MODE_NEG, IR_SUB, true, MODE_NEG, false},
+    {SUB, MODE_VAL, MODE_VAL, IR_SUB, false, MODE_VAL, false}, {SUB, MODE_VAL, MODE_NEG, IR_ADD, false, MODE_VAL, false},
+    {SUB, MODE_NEG, MODE_NEG, IR_SUB, true, MODE_VAL, false},  {SUB, MODE_VAL, MODE_VAL, IR_SUB, true, MODE_NEG, false},
+    {SUB, MODE_NEG, MODE_VAL, IR_ADD, false, MODE_NEG, false}, {SUB, MODE_NEG, MODE_NEG, IR_SUB, false, MODE_NEG, false},
+    {MUL, MODE_VAL, MODE_VAL, IR_MUL, false, MODE_VAL, false}, {MUL, MODE_NEG, MODE_NEG, IR_MUL, false, MODE_VAL, false},
+    {MUL, MODE_VAL, MODE_NEG, IR_MUL, false, MODE_NEG, false}, {MUL, MODE_NEG, MODE_VAL, IR_MUL, false, MODE_NEG, false},
+    {DIV, MODE_VAL, MODE_VAL, IR_DIV, false, MODE_VAL, false}, {DIV, MODE_VAL, MODE_NEG, IR_DIV, false, MODE_NEG, true},
+    {REM, MODE_VAL, MODE_VAL, IR_REM, false, MODE_VAL, false}, {REM, MODE_VAL, MODE_NEG, IR_REM, false, MODE_VAL, true}};
+
+// 敘述一個一個從 stdin 讀進來編譯，長度和數量都沒有限制；只有中間碼會留到最後
+int main(int argc, char* argv[]) {
     // FILE* file = fopen("testcase/test4.in", "r");
     // if (file == NULL) {
     //     perror("Failed to open file");
     //     return 1;
     // }
-    while (instruction_count < MAX_INSTRUCTIONS && fgets(input, MAX_LENGTH, stdin) != NULL) {
-        strncpy(instructions[instruction_count].instruction, input, MAX_LENGTH - 1);
-        instructions[instruction_count].instruction[MAX_LENGTH - 1] = '\0';
-        instruction_count++;
-    }
-    // fclose(file);
-    for (int i = 0; i < instruction_count; i++) {
-        Token* content = lexer(instructions[i].instruction);
-        size_t len = token_list_to_arr(&content);
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {  // 直接執行原始程式，印出預期的結果
+        int *roots = NULL, count = 0, cap = 0;  // 要重複執行，所以每個敘述的節點都留著，不歸零
+        while (read_statement()) {
+            size_t len;
+            Token* content = lexer(stmt_text, &len);
+            if (len == 0)
+                continue;
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                roots = (int*)realloc(roots, sizeof(int) * cap);
+            }
+            int first = ast_len;
+            roots[count] = parser(content, len);
+            if (roots[count] != NIL)
+                semantic_check(first, roots[count++]);
+        }
+        int res = run_interpreter(roots, count, argc - 2, argv + 2);
+        free(roots);
+        return res;
+    }
+    init_registers();  // x, y, z 的暫存器描述在整個程式中共用
+    for (int i = 0; read_statement(); i++) {
+        size_t len;
+        Token* content = lexer(stmt_text, &len);
         if (len == 0)
             continue;
-        for (int i = 0; i < NUM_REGISTERS; i++)  // Initialize
-            reg[i] = 0;
-        AST* ast_root = parser(content, len);
+        ast_len = 0;
+        int ast_root = parser(content, len);
         // token_print(content, len);
         // AST_print(ast_root);
-        semantic_check(ast_root);
-        init_registers();
-        codegen(ast_root);
-        // codegen2(ast_root);
-        free(content);
-        freeAST(ast_root);
+        if (ast_root == NIL)
+            continue;
+        semantic_check(0, ast_root);
+        fold_constants(0, ast_root);
+        ast_root = simplify(ast_root);
+        ast_root = normalize_linear(ast_root);
+        ast_root = relayout(0, ast_root);  // 化簡後新舊節點交錯，重新排回後序並丟掉不用的節點
+        select_tiles(0, ast_root);
+        cur_stmt = i;
+        codegen(ast_root, MODE_VAL);
+    }
+    remove_dead_stores();
+    remove_dead_code();
+    // IR_print();
+    allocate_registers();
+    print_program();
+}
+
+// 讀出下一個以 ';' 結尾的敘述放進 stmt_text；檔案結尾沒有 ';' 的剩餘文字也當成一個敘述，留給 parser 報錯
+bool read_statement() {
+    size_t len = 0;
+    while (true) {
+        if (read_pos == read_len) {
+            read_pos = 0;
+            read_len = fread(read_buf, 1, READ_CHUNK, stdin);
+            if (read_len == 0)
+                break;
+        }
+        char* end = (char*)memchr(read_buf + read_pos, ';', read_len - read_pos);
+        size_t n = end != NULL ? (size_t)(end - read_buf) + 1 - read_pos : read_len - read_pos;
+        if (len + n + 1 > stmt_cap) {
+            stmt_cap = stmt_cap * 2 > len + n + 1 ? stmt_cap * 2 : len + n + 1;
+            stmt_text = (char*)realloc(stmt_text, stmt_cap);
+        }
+        memcpy(stmt_text + len, read_buf + read_pos, n);
+        len += n;
+        read_pos += n;
+        if (end != NULL)
+            break;
     }
+    if (len == 0)
+        return false;
+    stmt_text[len] = '\0';
+    return true;
 }
 
-Token* lexer(const char* in) {
-    Token* head = NULL;
-    Token** now = &head;
+// token 直接寫進共用的陣列，下一個敘述會從頭覆寫，不需要逐個 malloc/free
+Token* lexer(const char* in, size_t* len) {
+    *len = 0;
     for (int i = 0; in[i]; i++) {
         if (isspace(in[i]))  // 忽略空白字符
             continue;
         else if (isdigit(in[i])) {
-            (*now) = new_token(CONSTANT, atoi(in + i));
+            new_token(CONSTANT, atoi(in + i), len);
             while (in[i + 1] && isdigit(in[i + 1]))
                 i++;
         } else if ('x' <= in[i] && in[i] <= 'z')  // 變量
-            (*now) = new_token(IDENTIFIER, in[i]);
+            new_token(IDENTIFIER, in[i], len);
         else
             switch (in[i]) {
                 case '=':
-                    (*now) = new_token(ASSIGN, 0);
+                    new_token(ASSIGN, 0, len);
                     break;
                 case '+':
                     if (in[i + 1] && in[i + 1] == '+') {
                         i++;  // 在lexer範圍內，所有"++"都將被標記為PREINC。
-                        (*now) = new_token(PREINC, 0);
+                        new_token(PREINC, 0, len);
                     }  // 在lexer範圍內，所有單個"+"都將被標記為PLUS。
                     else
-                        (*now) = new_token(PLUS, 0);
+                        new_token(PLUS, 0, len);
                     break;
                 case '-':
                     if (in[i + 1] && in[i + 1] == '-') {
                         i++;  // 在lexer範圍內，所有"--"都將被標記為PREDEC。
 
-                        (*now) = new_token(PREDEC, 0);
+                        new_token(PREDEC, 0, len);
                     }  // 在lexer範圍內，所有單個"-"都將被標記為MINUS。
                     else
-                        (*now) = new_token(MINUS, 0);
+                        new_token(MINUS, 0, len);
                     break;
                 case '*':
-                    (*now) = new_token(MUL, 0);
+                    new_token(MUL, 0, len);
                     break;
                 case '/':
-                    (*now) = new_token(DIV, 0);
+                    new_token(DIV, 0, len);
                     break;
                 case '%':
-                    (*now) = new_token(REM, 0);
+                    new_token(REM, 0, len);
                     break;
                 case '(':
-                    (*now) = new_token(LPAR, 0);
+                    new_token(LPAR, 0, len);
                     break;
                 case ')':
-                    (*now) = new_token(RPAR, 0);
+                    new_token(RPAR, 0, len);
                     break;
                 case ';':
-                    (*now) = new_token(END, 0);
+                    new_token(END, 0, len);
                     break;
                 default:
                     err("Unexpected character.");
             }
-        now = &((*now)->next);
-    }
-    return head;
-}
-
-void print_register() {  // 先註解掉
-    for (int i = 0; i < NUM_REGISTERS; i++) {
-        if (registers[i].in_use) {
-            // printf("Register r%d: in use, Token kind: %d, Token value: %d\n", i, registers[i].token.kind, registers[i].token.val);
-        }
     }
+    return tokens;
 }
 
-Token* new_token(Kind kind, int val) {
-    Token* res = (Token*)malloc(sizeof(Token));
-    res->kind = kind;
-    res->val = val;
-    res->next = NULL;
-    return res;
-}
-
-size_t token_list_to_arr(Token** head) {
-    size_t res;
-    Token *now = (*head), *del;
-    for (res = 0; now != NULL; res++)
-        now = now->next;
-    now = (*head);
-    if (res != 0)
-        (*head) = (Token*)malloc(sizeof(Token) * res);
-    for (int i = 0; i < res; i++) {
-        (*head)[i] = (*now);
-        del = now;
-        now = now->next;
-        free(del);
+void new_token(Kind kind, int val, size_t* len) {
+    if (*len == token_cap) {
+        token_cap = token_cap ? token_cap * 2 : 64;
+        tokens = (Token*)realloc(tokens, sizeof(Token) * token_cap);
     }
-    return res;
+    tokens[*len].kind = kind;
+    tokens[*len].val = val;
+    (*len)++;
 }
-
-AST* parser(Token* arr, size_t len) {
+int parser(Token* arr, size_t len) {
     for (int i = 1; i < len; i++) {  // 正確識別"ADD"和"SUB"
         if (arr[i].kind == PLUS || arr[i].kind == MINUS) {
             switch (arr[i - 1].kind) {
@@ -243,104 +528,171 @@ AST* parser(Token* arr, size_t len) {
             }
         }
     }
+    build_sections(arr, len);
     return parse(arr, 0, len - 1, STMT);
 }
 
-AST* parse(Token* arr, int l, int r, GrammarState S) {
-    AST* now = NULL;
-    if (l > r)
-        err("Unexpected parsing range.");
-    int nxt;
-    switch (S) {
-        case STMT:
-            if (l == r && arr[l].kind == END)
-                return NULL;
-            else if (arr[r].kind == END)
-                return parse(arr, l, r - 1, EXPR);
-            else
-                err("Expected \';\' at the end of line.");
-        case EXPR:
-            return parse(arr, l, r, ASSIGN_EXPR);
-        case ASSIGN_EXPR:
-            if ((nxt = findNextSection(arr, l, r, condASSIGN)) != -1) {
-                now = new_AST(arr[nxt].kind, 0);
-                now->lhs = parse(arr, l, nxt - 1, UNARY_EXPR);
-                now->rhs = parse(arr, nxt + 1, r, ASSIGN_EXPR);
-                return now;
-            }
-            return parse(arr, l, r, ADD_EXPR);
-        case ADD_EXPR:  // 加法符
-            if ((nxt = findNextSection(arr, r, l, condADD)) != -1) {
-                now = new_AST(arr[nxt].kind, 0);
-                now->lhs = parse(arr, l, nxt - 1, ADD_EXPR);
-                now->rhs = parse(arr, nxt + 1, r, MUL_EXPR);
-                return now;
-            }
-            return parse(arr, l, r, MUL_EXPR);
-        case MUL_EXPR:  // 乘法符 TODO
-            if ((nxt = findNextSection(arr, r, l, condMUL)) != -1) {
-                now = new_AST(arr[nxt].kind, 0);
-                now->lhs = parse(arr, l, nxt - 1, MUL_EXPR);
-                now->rhs = parse(arr, nxt + 1, r, UNARY_EXPR);
-                return now;
-            }
-            return parse(arr, l, r, UNARY_EXPR);
-        case UNARY_EXPR:
-            if (arr[l].kind == SUB || arr[l].kind == MINUS || arr[l].kind == PREINC || arr[l].kind == PREDEC ||
-                arr[l].kind == PLUS) {  // 一元運算符
-                // if (arr[l].kind == MINUS) {
-                //     err("Negative numbers are not allowed.");
-                // }
-                now = new_AST(arr[l].kind, 0);
-                now->mid = parse(arr, l + 1, r, UNARY_EXPR);
-                return now;
-            }
-            return parse(arr, l, r, POSTFIX_EXPR);
-        case POSTFIX_EXPR:
-            if (arr[r].kind == PREINC || arr[r].kind == PREDEC) {  // 將"PREINC"、"PREDEC"轉換為"POSTINC"、"POSTDEC"
-                now = new_AST(arr[r].kind - PREINC + POSTINC, 0);
-                now->mid = parse(arr, l, r - 1, POSTFIX_EXPR);
-                return now;
-            }
-            return parse(arr, l, r, PRI_EXPR);
-        case PRI_EXPR:
-            if (findNextSection(arr, l, r, condRPAR) == r) {
-                now = new_AST(LPAR, 0);
-                now->mid = parse(arr, l + 1, r - 1, EXPR);
-                return now;
-            }
-            if (l == r) {
-                if (arr[l].kind == IDENTIFIER || arr[l].kind == CONSTANT)
-                    return new_AST(arr[l].kind, arr[l].val);
-                err("Unexpected token during parsing.");
+// 遞迴下降改成用 heap 上的工作堆疊：二元節點先推「建節點」，再推右、左兩個範圍，所以左子樹會先被 parse，
+// 子節點也都比父節點先建立，節點在 ast[] 中就是後序排列。建好的子樹放在 results 裡等父節點取用。
+int parse(Token* arr, int l, int r, GrammarState S) {
+    static ParseTask* tasks = NULL;
+    static int* results = NULL;
+    static int task_cap = 0, result_cap = 0;
+    int top = 0, len = 0, nxt;
+    RESERVE(tasks, task_cap, 1);
+    tasks[top++] = (ParseTask){l, r, S, 0, END};
+    while (top > 0) {
+        ParseTask t = tasks[--top];
+        if (t.arity == 2) {
+            len--;
+            results[len - 1] = new_binary(t.kind, results[len - 1], results[len]);
+            continue;
+        }
+        if (t.arity == 1) {
+            results[len - 1] = new_unary(t.kind, results[len - 1]);
+            continue;
+        }
+        l = t.l, r = t.r, S = t.S;
+        RESERVE(tasks, task_cap, top + 3);
+        RESERVE(results, result_cap, len + 1);
+        for (bool done = false; !done;) {  // 只換文法狀態時不用推新的工作，直接在這裡繼續
+            if (l > r)
+                err("Unexpected parsing range.");
+            done = true;
+            switch (S) {
+                case STMT:
+                    if (l == r && arr[l].kind == END)
+                        results[len++] = NIL;
+                    else if (arr[r].kind == END)
+                        r--, S = EXPR, done = false;
+                    else
+                        err("Expected \';\' at the end of line.");
+                    break;
+                case EXPR:
+                    S = ASSIGN_EXPR, done = false;
+                    break;
+                case ASSIGN_EXPR:
+                    if ((nxt = sections[l].next_assign) != -1 && nxt <= r) {
+                        tasks[top++] = (ParseTask){0, 0, STMT, 2, arr[nxt].kind};
+                        tasks[top++] = (ParseTask){nxt + 1, r, ASSIGN_EXPR, 0, END};
+                        tasks[top++] = (ParseTask){l, nxt - 1, UNARY_EXPR, 0, END};
+                    } else
+                        S = ADD_EXPR, done = false;
+                    break;
+                case ADD_EXPR:  // 加法符
+                    if ((nxt = sections[r].prev_add) >= l) {
+                        tasks[top++] = (ParseTask){0, 0, STMT, 2, arr[nxt].kind};
+                        tasks[top++] = (ParseTask){nxt + 1, r, MUL_EXPR, 0, END};
+                        tasks[top++] = (ParseTask){l, nxt - 1, ADD_EXPR, 0, END};
+                    } else
+                        S = MUL_EXPR, done = false;
+                    break;
+                case MUL_EXPR:  // 乘法符 TODO
+                    if ((nxt = sections[r].prev_mul) >= l) {
+                        tasks[top++] = (ParseTask){0, 0, STMT, 2, arr[nxt].kind};
+                        tasks[top++] = (ParseTask){nxt + 1, r, UNARY_EXPR, 0, END};
+                        tasks[top++] = (ParseTask){l, nxt - 1, MUL_EXPR, 0, END};
+                    } else
+                        S = UNARY_EXPR, done = false;
+                    break;
+                case UNARY_EXPR:
+                    if (arr[l].kind == SUB || arr[l].kind == MINUS || arr[l].kind == PREINC || arr[l].kind == PREDEC ||
+                        arr[l].kind == PLUS) {  // 一元運算符
+                        // if (arr[l].kind == MINUS) {
+                        //     err("Negative numbers are not allowed.");
+                        // }
+                        tasks[top++] = (ParseTask){0, 0, STMT, 1, arr[l].kind};
+                        tasks[top++] = (ParseTask){l + 1, r, UNARY_EXPR, 0, END};
+                    } else
+                        S = POSTFIX_EXPR, done = false;
+                    break;
+                case POSTFIX_EXPR:
+                    if (arr[r].kind == PREINC || arr[r].kind == PREDEC) {  // 將"PREINC"、"PREDEC"轉換為"POSTINC"、"POSTDEC"
+                        tasks[top++] = (ParseTask){0, 0, STMT, 1, arr[r].kind - PREINC + POSTINC};
+                        tasks[top++] = (ParseTask){l, r - 1, POSTFIX_EXPR, 0, END};
+                    } else
+                        S = PRI_EXPR, done = false;
+                    break;
+                case PRI_EXPR:
+                    if (sections[l].next_rpar == r) {
+                        tasks[top++] = (ParseTask){0, 0, STMT, 1, LPAR};
+                        tasks[top++] = (ParseTask){l + 1, r - 1, EXPR, 0, END};
+                        break;
+                    }
+                    if (l == r) {
+                        if (arr[l].kind == IDENTIFIER || arr[l].kind == CONSTANT) {
+                            results[len++] = new_AST(arr[l].kind, arr[l].val);
+                            break;
+                        }
+                        err("Unexpected token during parsing.");
+                    }
+                    printf("Error at line: %d, l: %d, r: %d\n", __LINE__, l, r);
+                    err("No token left for parsing.");
+                default:
+                    err("Unexpected grammar state.");
             }
-            printf("Error at line: %d, l: %d, r: %d\n", __LINE__, l, r);
-            err("No token left for parsing.");
-        default:
-            err("Unexpected grammar state.");
+        }
     }
+    return results[0];
 }
 
-AST* new_AST(Kind kind, int val) {
-    AST* res = (AST*)malloc(sizeof(AST));
+// 節點接在 ast[] 的尾端；陣列可能被 realloc 搬走，呼叫之後要重新用編號取節點。
+// 新節點和子節點被換掉的節點都要呼叫 label_node()，need、impure、hash 才會是對的
+int new_AST(Kind kind, int val) {
+    if (ast_len == ast_cap) {
+        ast_cap = ast_cap ? ast_cap * 2 : 64;
+        ast = (AST*)realloc(ast, sizeof(AST) * ast_cap);
+    }
+    AST* res = &ast[ast_len];
     res->kind = kind;
     res->val = val;
-    res->lhs = res->mid = res->rhs = NULL;
+    res->lhs = res->mid = res->rhs = NIL;
+    res->need = 0;
+    res->impure = false;
+    res->hash = 0;
+    if (kind == CONSTANT || kind == IDENTIFIER)  // 其他節點等子節點接上之後再標記
+        label_node(ast_len);
+    return ast_len++;
+}
+
+int new_unary(Kind kind, int mid) {
+    int res = new_AST(kind, 0);
+    ast[res].mid = mid;
+    label_node(res);
     return res;
 }
 
-int findNextSection(Token* arr, int start, int end, int (*cond)(Kind)) {
-    int par = 0;
-    int d = (start < end) ? 1 : -1;
-    for (int i = start; (start < end) ? (i <= end) : (i >= end); i += d) {
-        if (arr[i].kind == LPAR)
-            par++;
-        if (arr[i].kind == RPAR)
-            par--;
-        if (par == 0 && cond(arr[i].kind) == 1)
-            return i;
+// 括號深度 D[i] 是 arr[0..i] 中 '(' 減 ')' 的數量。從 l 往右掃到深度回到 D[l - 1] 的 '=' 或 ')'，
+// 和從 r 往左掃到深度等於 D[r] 的運算子，都可以先各用一次線性掃描對每個位置算好
+void build_sections(Token* arr, int len) {
+    int depth = len, *last[2];  // 深度加上 len 當索引，範圍是 [0, 2 * len]
+    if ((size_t)len > section_cap) {
+        section_cap = len;
+        sections = (Section*)realloc(sections, sizeof(Section) * section_cap);
+        section_last = (int*)realloc(section_last, sizeof(int) * 2 * (2 * section_cap + 1));
+    }
+    last[0] = section_last;
+    last[1] = section_last + 2 * len + 1;
+    memset(section_last, -1, sizeof(int) * 2 * (2 * len + 1));
+    for (int i = 0; i < len; i++) {  // 這時 depth 是 D[i]
+        depth += (arr[i].kind == LPAR) - (arr[i].kind == RPAR);
+        if (condADD(arr[i].kind))
+            last[0][depth] = i;
+        if (condMUL(arr[i].kind))
+            last[1][depth] = i;
+        sections[i].prev_add = last[0][depth];
+        sections[i].prev_mul = last[1][depth];
+    }
+    memset(section_last, -1, sizeof(int) * 2 * (2 * len + 1));
+    for (int i = len - 1; i >= 0; i--) {  // 先記下 D[i]，再退回 D[i - 1]
+        if (condASSIGN(arr[i].kind))
+            last[0][depth] = i;
+        if (condRPAR(arr[i].kind))
+            last[1][depth] = i;
+        depth -= (arr[i].kind == LPAR) - (arr[i].kind == RPAR);
+        sections[i].next_assign = last[0][depth];
+        sections[i].next_rpar = last[1][depth];
     }
-    return -1;
 }
 
 int condASSIGN(Kind kind) {
@@ -359,769 +711,1852 @@ int condRPAR(Kind kind) {
     return kind == RPAR;
 }
 
-void semantic_check(AST* now) {
-    if (now == NULL)
-        return;
-    if (now->kind == ASSIGN) {
-        AST* tmp = now->lhs;
-        while (tmp->kind == LPAR)
-            tmp = tmp->mid;
-        if (tmp->kind != IDENTIFIER)
-            err("Lvalue is required as left operand of assignment.");
+// 剛 parse 完的敘述在 ast[first..root] 中連續存放，不用走訪樹，直接掃過每個節點
+void semantic_check(int first, int root) {
+    for (int now = first; now <= root; now++) {
+        if (ast[now].kind == ASSIGN) {
+            int tmp = ast[now].lhs;
+            while (ast[tmp].kind == LPAR)
+                tmp = ast[tmp].mid;
+            if (ast[tmp].kind != IDENTIFIER)
+                err("Lvalue is required as left operand of assignment.");
+        }
+        if (ast[now].kind == PREINC || ast[now].kind == PREDEC || ast[now].kind == POSTINC ||
+            ast[now].kind == POSTDEC) {
+            int tmp = ast[now].mid;
+            while (ast[tmp].kind == LPAR)  // 和 GCC 一樣，只接受加上括號的變數
+                tmp = ast[tmp].mid;
+            if (ast[tmp].kind != IDENTIFIER)
+                err("Operand of INC/DEC must be an identifier or identifier with parentheses.");
+        }
     }
-    if (now->kind == PREINC || now->kind == PREDEC || now->kind == POSTINC || now->kind == POSTDEC) {
-        AST* tmp = now->mid;
-        while (tmp->kind == LPAR || tmp->kind == PLUS || tmp->kind == MINUS || tmp->kind == PREDEC || tmp->kind == PREINC || tmp->kind == POSTDEC || tmp->kind == POSTINC)
-            tmp = tmp->mid;
-        if (tmp->kind != IDENTIFIER)
-            err("Operand of INC/DEC must be an identifier or identifier with parentheses.");
+}
+
+// 依照 ASMC evaluate() 的整數語意計算：32 位元溢位繞回、除法向零截斷。
+// 除以 0 和 INT_MIN / -1 在 ASMC 執行時會出錯，回傳 false 留給執行期處理。
+bool eval_arith(Kind kind, int left, int right, int* res) {
+    switch (kind) {
+        case ADD:
+            *res = (int)((unsigned)left + (unsigned)right);
+            return true;
+        case SUB:
+            *res = (int)((unsigned)left - (unsigned)right);
+            return true;
+        case MUL:
+            *res = (int)((unsigned)left * (unsigned)right);
+            return true;
+        case DIV:
+        case REM:
+            if (right == 0 || (left == -2147483647 - 1 && right == -1))
+                return false;
+            *res = kind == DIV ? left / right : left % right;
+            return true;
+        default:
+            return false;
     }
-    semantic_check(now->lhs);
-    semantic_check(now->mid);
-    semantic_check(now->rhs);
 }
 
-int get_register_for_variable(char var) {
-    switch (var) {
-        case 'x':
-            return 0;  // x 存儲在 memory[0]
-        case 'y':
-            return 4;  // y 存儲在 memory[4]
-        case 'z':
-            return 8;  // z 存儲在 memory[8]
+// 由下往上把只含常數的子樹換成一個 CONSTANT 節點；後序排列時照編號掃過去就是由下往上
+void fold_constants(int first, int root) {
+    for (int now = first; now <= root; now++)
+        fold_node(now);
+}
+
+// 子節點都已經是常數時，把 now 本身換成 CONSTANT
+void fold_node(int now) {
+    int val;
+    switch (ast[now].kind) {
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case REM:
+            if (ast[ast[now].lhs].kind != CONSTANT || ast[ast[now].rhs].kind != CONSTANT)
+                return;
+            if (!eval_arith(ast[now].kind, ast[ast[now].lhs].val, ast[ast[now].rhs].val, &val))
+                return;
+            break;
+        case MINUS:
+            if (ast[ast[now].mid].kind != CONSTANT)
+                return;
+            val = (int)(0u - (unsigned)ast[ast[now].mid].val);
+            break;
+        case PLUS:
+        case LPAR:
+            if (ast[ast[now].mid].kind != CONSTANT)
+                return;
+            val = ast[ast[now].mid].val;
+            break;
         default:
-            return -1;  // 錯誤
+            return;
     }
+    ast[now].lhs = ast[now].mid = ast[now].rhs = NIL;  // 子節點留在陣列裡，敘述結束時一起歸零
+    ast[now].kind = CONSTANT;
+    ast[now].val = val;
 }
-// simplfiy use
-NodeInfo get_node_info(AST* root) {
-    NodeInfo info = {root->kind, root->val};  // 初始化結果
-    while (root->kind == LPAR) {
-        if (root->mid->kind != LPAR && root->mid->kind != CONSTANT && root->mid->kind != IDENTIFIER) {
-            info.kinds = root->mid->kind;
-            info.val = root->mid->val;
-            return info;  // 是其他類型
-        }
-        if (root->mid->kind == LPAR) {
-            root = root->mid;  // 繼續查找
-        } else {
-            info.kinds = root->mid->kind;
-            info.val = root->mid->val;
-            return info;  // 有常數或標識符
-        }
+
+// 依序是 lhs、mid、rhs
+int child_of(int now, int i) {
+    return i == 0 ? ast[now].lhs : i == 1 ? ast[now].mid : ast[now].rhs;
+}
+
+// 把 root 子樹的節點照後序寫進 post_order[]，回傳節點數。先照「根、右、中、左」的順序走，反過來就是後序
+int post_order_of(int root) {
+    int top = 0, len = 0;
+    RESERVE(post_order, post_order_cap, ast_len);
+    RESERVE(walk_stack, walk_cap, ast_len);
+    walk_stack[top++] = root;
+    while (top > 0) {
+        int now = walk_stack[--top];
+        post_order[len++] = now;
+        for (int i = 0; i < 3; i++)
+            if (child_of(now, i) != NIL)
+                walk_stack[top++] = child_of(now, i);
     }
-    return info;
+    for (int i = 0, j = len - 1; i < j; i++, j--) {
+        int tmp = post_order[i];
+        post_order[i] = post_order[j];
+        post_order[j] = tmp;
+    }
+    return len;
 }
 
-void init_registers() {
-    for (int i = 0; i < NUM_REGISTERS; i++) {
-        registers[i].in_use = false;
-        registers[i].changed = false;
-        registers[i].token.kind = 0;
-        registers[i].token.val = 0;
-    }
-}
-
-Register* assign_register(Token token) {
-    // 遍歷暫存器列表
-    for (int i = 0; i < NUM_REGISTERS; i++)
-        if (registers[i].in_use && !registers[i].changed && registers[i].token.kind == token.kind &&
-            registers[i].token.val == token.val)  // 找到匹配的暫存器
-            return &registers[i];
-    // 如果沒有找到匹配的暫存器，分配一個新的暫存器
-    for (int i = 0; i < NUM_REGISTERS; i++) {
-        if (!registers[i].in_use) {
-            registers[i].in_use = true;
-            registers[i].changed = false;
-            registers[i].token = token;
-            return &registers[i];
+bool has_side_effect(int now) {
+    return now != NIL && ast[now].impure;
+}
+
+bool same_expr(int a, int b) {
+    static int* stack = NULL;  // 還沒比較的節點，兩兩一組
+    static int cap = 0;
+    int top = 0;
+    if (a == NIL || b == NIL)
+        return a == b;
+    RESERVE(stack, cap, 2 * ast_len);
+    stack[top++] = a;
+    stack[top++] = b;
+    while (top > 0) {
+        b = stack[--top];
+        a = stack[--top];
+        if (ast[a].kind != ast[b].kind || ast[a].val != ast[b].val)
+            return false;
+        for (int i = 0; i < 3; i++) {
+            if ((child_of(a, i) == NIL) != (child_of(b, i) == NIL))
+                return false;
+            if (child_of(a, i) != NIL) {
+                stack[top++] = child_of(a, i);
+                stack[top++] = child_of(b, i);
+            }
         }
     }
-    // 如果所有暫存器都在使用中，返回 NULL
-    return NULL;
+    return true;
+}
+
+bool is_const(int now, int val) {
+    return ast[now].kind == CONSTANT && ast[now].val == val;
+}
+
+int negate(int now) {
+    return new_unary(MINUS, now);
+}
+
+// 只把 kind 換掉，保留左右子樹
+int retag(int now, Kind kind, int lhs, int rhs) {
+    ast[now].kind = kind;
+    ast[now].lhs = lhs;
+    ast[now].rhs = rhs;
+    return now;
 }
 
-void free_register(int reg_num) {
-    if (reg_num >= 0 && reg_num < NUM_REGISTERS) {
-        registers[reg_num].in_use = false;
-        registers[reg_num].changed = false;
-        registers[reg_num].token.kind = 0;
-        registers[reg_num].token.val = 0;
+// 剝掉 MINUS 外殼
+int strip_minus(int now) {
+    return ast[now].mid;
+}
+
+// 由下往上化簡整棵樹。每個框架是一個正在化簡的節點，子節點化簡完才輪到 simplify_node()；
+// 它要求重新化簡時，直接把框架換成新的節點，算完再補上要求的負號。新節點的子節點都化簡過了，
+// 所以不會再走一次子樹，每個節點只會被重新化簡常數次。
+int simplify(int root) {
+    static SimplifyFrame* stack = NULL;
+    static int cap = 0;
+    int top = 0, ret = NIL;
+    RESERVE(stack, cap, 1);
+    stack[top++] = (SimplifyFrame){root, 0, 0, {NIL, NIL, NIL}};
+    while (top > 0) {
+        SimplifyFrame* f = &stack[top - 1];
+        if (f->now != NIL && f->stage < 3) {
+            int child = child_of(f->now, f->stage);
+            if (child == NIL) {
+                f->kid[f->stage++] = NIL;
+                continue;
+            }
+            RESERVE(stack, cap, top + 1);
+            stack[top++] = (SimplifyFrame){child, 0, 0, {NIL, NIL, NIL}};
+            continue;
+        }
+        ret = f->now;
+        if (ret != NIL) {
+            bool again = false;
+            ast[ret].lhs = f->kid[0];
+            ast[ret].mid = f->kid[1];
+            ast[ret].rhs = f->kid[2];
+            fold_node(ret);
+            label_node(ret);
+            ret = simplify_node(ret, &again, &f->negs);
+            if (again) {  // 新節點的子節點都已經化簡過，只要再化簡它自己
+                f->now = ret;
+                for (int i = 0; i < 3; i++)
+                    f->kid[i] = child_of(ret, i);
+                continue;
+            }
+            for (; f->negs > 0; f->negs--)
+                ret = negate(ret);
+        }
+        if (--top > 0)
+            stack[top - 1].kid[stack[top - 1].stage++] = ret;
     }
+    return ret;
 }
 
-int codegen(AST* root) {
-    if (root == NULL)
-        return -1;
-    int left, right, r, is_lc, is_rc;  // 寄存器變量
-    NodeInfo node_info_left, node_info_right;
-    int vr;
-    Token token;
-    switch (root->kind) {
-        case ASSIGN:
-            node_info_left = get_node_info(root->lhs);
-            if (node_info_left.kinds == IDENTIFIER)
-                vr = node_info_left.val;
-            else
-                vr = root->lhs->val;
-            right = codegen(root->rhs);
-            node_info_right = get_node_info(root->rhs);
-            if (node_info_right.kinds == CONSTANT) {
-                Token token = {CONSTANT, root->rhs->val};
-                Register* reg = assign_register(token);
-                if (reg != NULL) {
-                    r = reg - registers;  // 計算暫存器索引
-                    printf("add r%d %d %d\n", r, 0, right);
-                    printf("store [%d] r%d\n", get_register_for_variable((char)vr), r);
-                    free_register(r);
-                    return r;
-                } else {
-                    err("No available register.");
-                }
-            } else {
-                printf("store [%d] r%d\n", get_register_for_variable((char)vr), right);
-                free_register(right);
+// 在 C 語意下成立的代數恆等式；有 ++、--、= 的子樹只會被搬動，不會被刪掉。
+// 負號盡量往上推，最後被外層的 add/sub 吸收掉。結果要再化簡一次時設 *again，外面要補的負號加在 *negs。
+// 被換掉的節點留在陣列裡，relayout() 時一起丟掉。
+int simplify_node(int now, bool* again, int* negs) {
+    int l = ast[now].lhs, r = ast[now].rhs;
+    switch (ast[now].kind) {
+        case LPAR:
+        case PLUS:
+            return ast[now].mid;
+        case MINUS:
+            if (ast[ast[now].mid].kind == MINUS)  // -(-a) = a
+                return strip_minus(strip_minus(now));
+            if (ast[ast[now].mid].kind == SUB) {  // -(a - b) = b - a
+                int res = ast[now].mid;
+                return retag(res, SUB, ast[res].rhs, ast[res].lhs);
             }
-            break;
+            return now;
         case ADD:
-            left = codegen(root->lhs);
-            right = codegen(root->rhs);
-            node_info_left = get_node_info(root->lhs);
-            is_lc = (node_info_left.kinds == CONSTANT);
-            node_info_right = get_node_info(root->rhs);
-            is_rc = (node_info_right.kinds == CONSTANT);
-            if (!is_lc && !is_rc) {
-                printf("add r%d r%d r%d\n", left, left, right);
-                registers[left].changed = true;
-                if (left != right)
-                    free_register(right);
-                return left;
-            } else if (!is_lc && is_rc) {
-                printf("add r%d r%d %d\n", left, left, right);
-                registers[left].changed = true;
-                return left;
-            } else if (is_lc && !is_rc) {
-                printf("add r%d %d r%d\n", right, left, right);
-                registers[right].changed = true;
-                return right;
-            } else {
-                token.kind = CONSTANT;
-                token.val = left + right;
-                Register* reg = assign_register(token);
-                if (reg == NULL)
-                    err("No available register.");
-                r = reg - registers;
-                printf("add r%d %d %d\n", r, left, right);
-                registers[r].changed = true;
+            if (is_const(r, 0))
+                return l;
+            if (is_const(l, 0))
                 return r;
+            if (ast[r].kind == MINUS)  // a + (-b) = a - b
+                return RESIMPLIFY(retag(now, SUB, l, strip_minus(r)));
+            if (ast[l].kind == MINUS)  // (-a) + b = b - a
+                return RESIMPLIFY(retag(now, SUB, r, strip_minus(l)));
+            if (ast[r].kind == CONSTANT && ast[r].val < 0 && ast[r].val != -2147483647 - 1) {  // a + (-c) = a - c
+                ast[r].val = -ast[r].val;
+                return retag(now, SUB, l, r);
             }
-            break;
+            if (ast[l].kind == CONSTANT && ast[l].val < 0 && ast[l].val != -2147483647 - 1) {  // (-c) + b = b - c
+                ast[l].val = -ast[l].val;
+                return retag(now, SUB, r, l);
+            }
+            return now;
         case SUB:
-            left = codegen(root->lhs);
-            right = codegen(root->rhs);
-            node_info_left = get_node_info(root->lhs);
-            is_lc = (node_info_left.kinds == CONSTANT);
-            node_info_right = get_node_info(root->rhs);
-            is_rc = (node_info_right.kinds == CONSTANT);
-            if (left == right) {
-                token.kind = CONSTANT;
-                token.val = 0;
-                Register* reg = assign_register(token);
-                if (reg == NULL)
-                    err("No available register.");
-                r = reg - registers;
-                printf("add r%d 0 0\n", r);
-                registers[r].changed = true;
-                return r;
-            } else if (!is_lc && !is_rc) {
-                printf("sub r%d r%d r%d\n", left, left, right);
-                registers[left].changed = true;
-                if (left != right)
-                    free_register(right);
-                return left;
-            } else if (!is_lc && is_rc) {
-                printf("sub r%d r%d %d\n", left, left, right);
-                registers[left].changed = true;
-                return left;
-            } else if (is_lc && !is_rc) {
-                printf("sub r%d %d r%d\n", right, left, right);
-                registers[right].changed = true;
-                return right;
-            } else {
-                token.kind = CONSTANT;
-                token.val = left - right;
-                Register* reg = assign_register(token);
-                if (reg == NULL)
-                    err("No available register.");
-                r = reg - registers;
-                printf("sub r%d %d %d\n", r, left, right);
-                registers[r].changed = true;
-                return r;
+            if (is_const(r, 0))
+                return l;
+            if (is_const(l, 0))  // 0 - a = -a
+                return RESIMPLIFY(negate(r));
+            if (same_expr(l, r) && !has_side_effect(l))
+                return new_AST(CONSTANT, 0);
+            if (ast[r].kind == MINUS)  // a - (-b) = a + b
+                return RESIMPLIFY(retag(now, ADD, l, strip_minus(r)));
+            if (ast[l].kind == MINUS) {  // (-a) - b = -(a + b)
+                ast[now].lhs = strip_minus(l);
+                ast[now].kind = ADD;
+                ++*negs;
+                return RESIMPLIFY(now);
             }
-            break;
+            if (ast[r].kind == CONSTANT && ast[r].val < 0 && ast[r].val != -2147483647 - 1) {  // a - (-c) = a + c
+                ast[r].val = -ast[r].val;
+                return retag(now, ADD, l, r);
+            }
+            return now;
         case MUL:
-            left = codegen(root->lhs);
-            right = codegen(root->rhs);
-            node_info_left = get_node_info(root->lhs);
-            is_lc = (node_info_left.kinds == CONSTANT);
-            node_info_right = get_node_info(root->rhs);
-            is_rc = (node_info_right.kinds == CONSTANT);
-            if (!is_lc && !is_rc) {
-                printf("mul r%d r%d r%d\n", left, left, right);
-                registers[left].changed = true;
-                if (left != right)
-                    free_register(right);
-                return left;
-            } else if (!is_lc && is_rc) {
-                printf("mul r%d r%d %d\n", left, left, right);
-                registers[left].changed = true;
-                return left;
-            } else if (is_lc && !is_rc) {
-                printf("mul r%d %d r%d\n", right, left, right);
-                registers[right].changed = true;
-                return right;
-            } else {
-                token.kind = CONSTANT;
-                token.val = left * right;
-                Register* reg = assign_register(token);
-                if (reg == NULL)
-                    err("No available register.");
-                r = reg - registers;
-                printf("mul r%d %d %d\n", r, left, right);
-                registers[r].changed = true;
+            if (is_const(r, 1))
+                return l;
+            if (is_const(l, 1))
                 return r;
-            }
+            if ((is_const(r, 0) && !has_side_effect(l)) || (is_const(l, 0) && !has_side_effect(r)))
+                return new_AST(CONSTANT, 0);
+            if (is_const(r, -1))
+                return RESIMPLIFY(negate(l));
+            if (is_const(l, -1))
+                return RESIMPLIFY(negate(r));
             break;
         case DIV:
-            left = codegen(root->lhs);
-            right = codegen(root->rhs);
-            node_info_left = get_node_info(root->lhs);
-            is_lc = (node_info_left.kinds == CONSTANT);
-            node_info_right = get_node_info(root->rhs);
-            is_rc = (node_info_right.kinds == CONSTANT);
-            if (!is_lc && !is_rc) {
-                printf("div r%d r%d r%d\n", left, left, right);
-                registers[left].changed = true;
-                if (left != right)
-                    free_register(right);
-                return left;
-            } else if (!is_lc && is_rc) {
-                printf("div r%d r%d %d\n", left, left, right);
-                registers[left].changed = true;
-                return left;
-            } else if (is_lc && !is_rc) {
-                printf("div r%d %d r%d\n", right, left, right);
-                registers[right].changed = true;
-                return right;
-            } else {
-                token.kind = CONSTANT;
-                token.val = left / right;
-                Register* reg = assign_register(token);
-                if (reg == NULL)
-                    err("No available register.");
-                r = reg - registers;
-                printf("div r%d %d %d\n", r, left, right);
-                registers[r].changed = true;
-                return r;
-            }
+            if (is_const(r, 1))
+                return l;
+            if (is_const(r, -1))
+                return RESIMPLIFY(negate(l));
+            if (same_expr(l, r) && !has_side_effect(l))  // a 為 0 是未定義行為，不會出現在測資中
+                return new_AST(CONSTANT, 1);
             break;
         case REM:
-            left = codegen(root->lhs);
-            right = codegen(root->rhs);
-            node_info_left = get_node_info(root->lhs);
-            is_lc = (node_info_left.kinds == CONSTANT);
-            node_info_right = get_node_info(root->rhs);
-            is_rc = (node_info_right.kinds == CONSTANT);
-            if (!is_lc && !is_rc) {
-                printf("rem r%d r%d r%d\n", left, left, right);
-                registers[left].changed = true;
-                free_register(right);
-                return left;
-            } else if (!is_lc && is_rc) {
-                printf("rem r%d r%d %d\n", left, left, right);
-                registers[left].changed = true;
-                return left;
-            } else if (is_lc && !is_rc) {
-                printf("rem r%d %d r%d\n", right, left, right);
-                registers[right].changed = true;
-                return right;
-            } else {
-                token.kind = CONSTANT;
-                token.val = left % right;
-                Register* reg = assign_register(token);
-                if (reg == NULL)
-                    err("No available register.");
-                r = reg - registers;
-                printf("rem r%d %d %d\n", r, left, right);
-                registers[r].changed = true;
-                return r;
+            if ((is_const(r, 1) || is_const(r, -1)) && !has_side_effect(l))
+                return new_AST(CONSTANT, 0);
+            if (same_expr(l, r) && !has_side_effect(l))
+                return new_AST(CONSTANT, 0);
+            if (ast[r].kind == MINUS) {  // a % (-b) = a % b
+                ast[now].rhs = strip_minus(r);
+                return RESIMPLIFY(now);
             }
-            break;
-        case PREINC:
-            right = codegen(root->mid);
-            node_info_left = get_node_info(root->mid);
-            if (node_info_left.kinds == IDENTIFIER)
-                vr = node_info_left.val;
+            if (ast[r].kind == CONSTANT && ast[r].val < 0 && ast[r].val != -2147483647 - 1) {
+                ast[r].val = -ast[r].val;
+                return now;
+            }
+            if (ast[l].kind == MINUS) {  // (-a) % b = -(a % b)
+                ast[now].lhs = strip_minus(l);
+                return negate(now);
+            }
+            return now;
+        default:
+            return now;
+    }
+    // MUL、DIV：兩邊的負號抵消，只剩一邊的負號提到外面
+    bool neg = false;
+    if (ast[l].kind == MINUS)
+        ast[now].lhs = strip_minus(l), neg = !neg;
+    else if (ast[l].kind == CONSTANT && ast[l].val < 0 && ast[l].val != -2147483647 - 1)
+        ast[l].val = -ast[l].val, neg = !neg;
+    if (ast[r].kind == MINUS)
+        ast[now].rhs = strip_minus(r), neg = !neg;
+    else if (ast[r].kind == CONSTANT && ast[r].val < 0 && ast[r].val != -2147483647 - 1)
+        ast[r].val = -ast[r].val, neg = !neg;
+    if (ast[now].lhs != l || ast[now].rhs != r || neg != false) {
+        *negs += neg;
+        return RESIMPLIFY(now);
+    }
+    return now;
+}
+
+void grow_linear_index(LinearForm* f) {
+    f->index_cap = f->index_cap ? f->index_cap * 2 : 16;
+    f->index = (int*)realloc(f->index, sizeof(int) * f->index_cap);
+    memset(f->index, -1, sizeof(int) * f->index_cap);
+    unsigned mask = f->index_cap - 1;
+    for (int k = 0; k < f->len; k++) {
+        if (f->terms[k].impure)
+            continue;
+        unsigned i = ast[f->terms[k].term].hash & mask;
+        while (f->index[i] != -1)
+            i = (i + 1) & mask;
+        f->index[i] = k;
+    }
+}
+
+// 把一項加進線性式，沒有副作用而且長得一樣的項直接合併係數；先用 hash 找，不用和每一項比較
+void add_linear_term(LinearForm* f, unsigned coef, int term) {
+    int* slot = NULL;
+    if (!ast[term].impure) {
+        if (2 * (f->len + 1) > f->index_cap)
+            grow_linear_index(f);
+        unsigned mask = f->index_cap - 1;
+        for (unsigned i = ast[term].hash & mask; *(slot = &f->index[i]) != -1; i = (i + 1) & mask) {
+            LinearTerm* t = &f->terms[*slot];
+            if (ast[t->term].hash == ast[term].hash && same_expr(t->term, term)) {
+                t->coef += coef;
+                return;
+            }
+        }
+        *slot = f->len;
+    }
+    if (f->len == f->cap) {
+        f->cap = f->cap ? f->cap * 2 : 8;
+        f->terms = (LinearTerm*)realloc(f->terms, sizeof(LinearTerm) * f->cap);
+    }
+    f->terms[f->len].coef = coef;
+    f->terms[f->len].term = term;
+    f->terms[f->len].impure = ast[term].impure;
+    f->len++;
+}
+
+// 從 collect_stack 取出這個線性式還沒收集的部分，把 +/- 串拆成「係數 * 項」的總和，常數全部併成一個；
+// 碰到要先正規化的項就回傳它並把係數放在 *coef，全部收集完回傳 NIL。係數用 unsigned 計算以符合溢位繞回
+int collect_terms(LinearForm* f, int base, unsigned* coef) {
+    while (collect_len > base) {
+        CollectItem it = collect_stack[--collect_len];
+        AST* now = &ast[it.now];
+        switch (now->kind) {
+            case ADD:
+            case SUB:  // 右邊先放，左邊會先被收集
+                RESERVE(collect_stack, collect_cap, collect_len + 2);
+                collect_stack[collect_len++] = (CollectItem){now->rhs, now->kind == ADD ? it.scale : 0u - it.scale};
+                collect_stack[collect_len++] = (CollectItem){now->lhs, it.scale};
+                break;
+            case MINUS:
+                collect_stack[collect_len++] = (CollectItem){now->mid, 0u - it.scale};
+                break;
+            case CONSTANT:
+                f->constant += it.scale * (unsigned)now->val;
+                break;
+            case MUL:
+                if (ast[now->lhs].kind == CONSTANT || ast[now->rhs].kind == CONSTANT) {
+                    int c = ast[now->lhs].kind == CONSTANT ? now->lhs : now->rhs;
+                    *coef = it.scale * (unsigned)ast[c].val;
+                    return c == now->lhs ? now->rhs : now->lhs;
+                }  // 沒有常數的乘法整個當成一項
+                // fall through
+            default:
+                *coef = it.scale;
+                return it.now;
+        }
+    }
+    return NIL;
+}
+
+int new_binary(Kind kind, int lhs, int rhs) {
+    int res = new_AST(kind, 0);
+    ast[res].lhs = lhs;
+    ast[res].rhs = rhs;
+    label_node(res);
+    return res;
+}
+
+// 有副作用的項維持原本的相對順序放在最前面，其餘依需要的暫存器數由多到少
+int cmp_linear_term(const void* a, const void* b) {
+    const LinearTerm *ta = (const LinearTerm*)a, *tb = (const LinearTerm*)b;
+    if (ta->impure != tb->impure)
+        return tb->impure - ta->impure;
+    if (ta->impure)
+        return ta->order - tb->order;
+    if (ast[ta->term].need != ast[tb->term].need)
+        return ast[tb->term].need - ast[ta->term].need;
+    return ta->order - tb->order;
+}
+
+int linear_term(LinearTerm* t, unsigned magnitude) {
+    if (magnitude == 1)
+        return t->term;
+    return new_binary(MUL, t->term, new_AST(CONSTANT, (int)magnitude));
+}
+
+// 正項相加、負項相減，常數最後當立即數加減；全部都是負項時前面放常數或最後補一個負號
+int rebuild_linear(LinearForm* f) {
+    int pos = NIL, neg = NIL;
+    int c = (int)f->constant;
+    for (int i = 0; i < f->len; i++)
+        f->terms[i].order = i;
+    qsort(f->terms, f->len, sizeof(LinearTerm), cmp_linear_term);
+    for (int i = 0; i < f->len; i++) {
+        LinearTerm* t = &f->terms[i];
+        if (t->coef == 0 && !t->impure) {
+            t->term = NIL;
+        } else if ((int)t->coef >= 0 || t->coef == 0x80000000u) {  // x * 0 有副作用時也要留著
+            int term = linear_term(t, t->coef);
+            pos = pos == NIL ? term : new_binary(ADD, pos, term);
+            t->term = NIL;
+        }
+    }
+    for (int i = 0; i < f->len; i++) {
+        LinearTerm* t = &f->terms[i];
+        if (t->term == NIL)
+            continue;
+        if (pos != NIL)
+            pos = new_binary(SUB, pos, linear_term(t, 0u - t->coef));
+        else
+            neg = neg == NIL ? linear_term(t, 0u - t->coef) : new_binary(ADD, neg, linear_term(t, 0u - t->coef));
+    }
+    if (neg != NIL && c > 0)  // c - a - b
+        return new_binary(SUB, new_AST(CONSTANT, c), neg);
+    if (neg != NIL && c < 0 && c != -2147483647 - 1)  // -(a + b + |c|)
+        return negate(new_binary(ADD, neg, new_AST(CONSTANT, -c)));
+    if (neg != NIL)
+        pos = negate(neg);
+    if (pos == NIL)
+        return new_AST(CONSTANT, c);
+    if (c > 0 || c == -2147483647 - 1)
+        return new_binary(ADD, pos, new_AST(CONSTANT, c));
+    if (c < 0)
+        return new_binary(SUB, pos, new_AST(CONSTANT, -c));
+    return pos;
+}
+
+// 把每一串 +/- 正規化成線性式後重新組出最便宜的形式。每個框架是一個正在正規化的節點；
+// 碰到 +/- 串時框架改成收集線性式，遇到要先正規化的項就再推一個框架，它的結果會加進這個線性式。
+int normalize_linear(int root) {
+    static NormalizeFrame* stack = NULL;
+    static int cap = 0;
+    int top = 0, ret = NIL;
+    RESERVE(stack, cap, 1);
+    stack[top++] = (NormalizeFrame){.now = root};
+    while (top > 0) {
+        NormalizeFrame* f = &stack[top - 1];
+        ret = f->now;
+        if (ret != NIL && f->stage == 0 && (ast[ret].kind == ADD || ast[ret].kind == SUB)) {
+            f->stage = -1;
+            f->base = collect_len;
+            RESERVE(collect_stack, collect_cap, collect_len + 1);
+            collect_stack[collect_len++] = (CollectItem){ret, 1};
+        }
+        if (ret != NIL && f->stage == -1) {
+            int term = collect_terms(&f->f, f->base, &f->coef);
+            if (term != NIL) {
+                RESERVE(stack, cap, top + 1);
+                stack[top++] = (NormalizeFrame){.now = term};
+                continue;
+            }
+            ret = rebuild_linear(&f->f);
+            free(f->f.terms);
+            free(f->f.index);
+        } else if (ret != NIL && f->stage < 3) {
+            int child = child_of(ret, f->stage);
+            if (child == NIL) {
+                f->kid[f->stage++] = NIL;
+                continue;
+            }
+            RESERVE(stack, cap, top + 1);
+            stack[top++] = (NormalizeFrame){.now = child};
+            continue;
+        } else if (ret != NIL) {
+            ast[ret].lhs = f->kid[0];
+            ast[ret].mid = f->kid[1];
+            ast[ret].rhs = f->kid[2];
+            label_node(ret);
+        }
+        if (--top > 0) {  // 把結果交給上一層
+            NormalizeFrame* up = &stack[top - 1];
+            if (up->stage == -1)
+                add_linear_term(&up->f, up->coef, ret);
             else
-                vr = root->mid->val;
-            printf("add r%d r%d 1\n", right, right);
-            printf("store [%d] r%d\n", get_register_for_variable((char)vr), right);
-            registers[right].changed = true;
-            return right;
+                up->kid[up->stage++] = ret;
+        }
+    }
+    return ret;
+}
+
+// 把子樹照後序複製到 ast[] 的尾端，回傳新的根
+int copy_post_order(int root) {
+    static int* stack = NULL;  // 已經複製好、還在等父節點的子樹
+    static int cap = 0;
+    if (root == NIL)
+        return NIL;
+    int len = post_order_of(root), top = 0;
+    RESERVE(stack, cap, len);
+    for (int i = 0; i < len; i++) {
+        int now = post_order[i], kid[3];
+        for (int c = 2; c >= 0; c--)
+            kid[c] = child_of(now, c) != NIL ? stack[--top] : NIL;
+        int res = new_AST(ast[now].kind, ast[now].val);
+        ast[res].lhs = kid[0];
+        ast[res].mid = kid[1];
+        ast[res].rhs = kid[2];
+        label_node(res);
+        stack[top++] = res;
+    }
+    return stack[0];
+}
+
+// 把從 root 走得到的節點重新排成後序，搬回 ast[first] 開始的位置，後面不用的節點直接丟掉
+int relayout(int first, int root) {
+    int end = ast_len;
+    root = copy_post_order(root);
+    int shift = end - first;
+    memmove(ast + first, ast + end, sizeof(AST) * (ast_len - end));
+    ast_len -= shift;
+    for (int i = first; i < ast_len; i++) {
+        if (ast[i].lhs != NIL)
+            ast[i].lhs -= shift;
+        if (ast[i].mid != NIL)
+            ast[i].mid -= shift;
+        if (ast[i].rhs != NIL)
+            ast[i].rhs -= shift;
+    }
+    return root - shift;
+}
+
+// 用子節點的結果算出 now 的 need、impure 和 hash，子節點要先標記好。常數可以當立即數所以不用暫存器
+void label_node(int now) {
+    AST* n = &ast[now];
+    int l, r;
+    switch (n->kind) {
+        case CONSTANT:
+            n->need = 0;
             break;
+        case IDENTIFIER:
+        case PREINC:
         case PREDEC:
-            right = codegen(root->mid);
-            node_info_left = get_node_info(root->mid);
-            if (node_info_left.kinds == IDENTIFIER)
-                vr = node_info_left.val;
-            else
-                vr = root->mid->val;
-            printf("sub r%d r%d 1\n", right, right);
-            printf("store [%d] r%d\n", get_register_for_variable((char)vr), right);
-            registers[right].changed = true;
-            return right;
+            n->need = 1;
             break;
         case POSTINC:
-            right = codegen(root->mid);
-            node_info_left = get_node_info(root->mid);
-            if (node_info_left.kinds == IDENTIFIER)
-                vr = node_info_left.val;
-            else
-                vr = root->mid->val;
-            token.kind = IDENTIFIER;
-            token.val = vr;
-            Register* reg = assign_register(token);
-            if (reg == NULL)
-                err("No available register.");
-            r = reg - registers;
-            printf("add r%d r%d 1\n", r, r);
-            printf("store [%d] r%d\n", get_register_for_variable((char)vr), r);
-            registers[r].changed = true;
-            free_register(r);
-            return right;
-            break;
         case POSTDEC:
-            right = codegen(root->mid);
-            node_info_left = get_node_info(root->mid);
-            if (node_info_left.kinds == IDENTIFIER)
-                vr = node_info_left.val;
-            else
-                vr = root->mid->val;
-            token.kind = IDENTIFIER;
-            token.val = vr;
-            reg = assign_register(token);
-            if (reg == NULL)
-                err("No available register.");
-            r = reg - registers;
-            printf("sub r%d r%d 1\n", r, r);
-            printf("store [%d] r%d\n", get_register_for_variable((char)vr), r);
-            registers[r].changed = true;
-            free_register(r);
-            return right;
-            break;
-        case IDENTIFIER:
-            token.kind = IDENTIFIER;
-            token.val = root->val;
-            for (int i = 0; i < NUM_REGISTERS; i++)
-                if (registers[i].in_use && !registers[i].changed && registers[i].token.kind == token.kind && registers[i].token.val == token.val) {
-                    // printf("same register\n");
-                    return i;
-                }
-            reg = assign_register(token);
-            if (reg == NULL)
-                err("No available register.");
-            r = reg - registers;
-            printf("load r%d [%d]\n", r, get_register_for_variable((char)root->val));
-            return r;
+            n->need = 2;  // 舊值和新值
             break;
-        case CONSTANT:
-            token.kind = CONSTANT;
-            token.val = root->val;
-            reg = assign_register(token);
-            if (reg == NULL)
-                err("No available register.");
-            r = reg - registers;
-            printf("add r%d 0 %d\n", r, root->val);
-            return r;
-            break;
-        case PLUS:
-            left = codegen(root->mid);
-            return left;
+        case ASSIGN:
+            n->need = ast[n->rhs].need > 1 ? ast[n->rhs].need : 1;
             break;
         case MINUS:
-            left = codegen(root->mid);
-            node_info_left = get_node_info(root->mid);
-            is_lc = (node_info_left.kinds == CONSTANT);
-            if (is_lc) {
-                token.kind = CONSTANT;
-                token.val = -left;
-                reg = assign_register(token);
-                if (reg == NULL)
-                    err("No available register.");
-                r = reg - registers;
-                printf("sub r%d 0 %d\n", r, left);
-                registers[r].changed = true;
-                return r;
-            } else {
-                printf("sub r%d 0 r%d\n", left, left);
-                registers[left].changed = true;
-                return left;
-            }
-            break;
+        case PLUS:
         case LPAR:
-            return codegen(root->mid);
-            break;
-        case RPAR:
-            return codegen(root->mid);
+            n->need = ast[n->mid].need > 1 ? ast[n->mid].need : 1;
             break;
         default:
-            break;
+            l = ast[n->lhs].need;
+            r = ast[n->rhs].need;
+            if (l == r)
+                n->need = l + 1;
+            else
+                n->need = l > r ? l : r;
     }
-    return 0;
-}
-//
-
-// no simplify
-int is_constant(AST* root) {  // check is constant or not
-    while (root->kind == LPAR) {
-        if (root->mid->kind != LPAR && root->mid->kind != CONSTANT)
-            return 0;  // is other kind
-        if (root->mid->kind == LPAR)
-            root = root->mid;  // continue find
-        else if (root->mid->kind == CONSTANT)
-            return 1;  // have constant
-        else
-            return 0;
+    n->impure = n->kind == ASSIGN || n->kind == PREINC || n->kind == PREDEC || n->kind == POSTINC ||
+                n->kind == POSTDEC;
+    n->hash = (unsigned)n->kind * 0x9E3779B1u ^ (unsigned)n->val;
+    for (int i = 0; i < 3; i++) {
+        int child = child_of(now, i);
+        n->impure |= child != NIL && ast[child].impure;
+        n->hash = (n->hash ^ (child != NIL ? ast[child].hash : 0x5BD1E995u + i)) * 0x85EBCA77u;
     }
+    n->hash ^= n->hash >> 15;
 }
 
-int have_identifier(AST* root) {  // check have identifier or not
-    while (root->kind == LPAR) {
-        if (root->mid->kind != LPAR && root->mid->kind != IDENTIFIER)
-            return 0;  // is other kind
-        if (root->mid->kind == LPAR)
-            root = root->mid;  // continue find
-        else if (root->mid->kind == IDENTIFIER)
-            return root->mid->val;  // return x/y/z
-        else
-            return 0;
+int get_register_for_variable(char var) {
+    switch (var) {
+        case 'x':
+            return 0;  // x 存儲在 memory[0]
+        case 'y':
+            return 4;  // y 存儲在 memory[4]
+        case 'z':
+            return 8;  // z 存儲在 memory[8]
+        default:
+            return -1;  // 錯誤
     }
-    return 0;
+}
+// simplfiy use
+NodeInfo get_node_info(int root) {
+    NodeInfo info = {ast[root].kind, ast[root].val};  // 初始化結果
+    while (ast[root].kind == LPAR) {
+        AST* mid = &ast[ast[root].mid];
+        if (mid->kind != LPAR && mid->kind != CONSTANT && mid->kind != IDENTIFIER) {
+            info.kinds = mid->kind;
+            info.val = mid->val;
+            return info;  // 是其他類型
+        }
+        if (mid->kind == LPAR) {
+            root = ast[root].mid;  // 繼續查找
+        } else {
+            info.kinds = mid->kind;
+            info.val = mid->val;
+            return info;  // 有常數或標識符
+        }
+    }
+    return info;
 }
 
-int codegen2(AST* root) {
-    if (root == NULL)
-        return -1;
-    int lv, rv;        // left and right operand's register
-    int r;             //(new) register
-    int is_lc, is_rc;  // is left or right a constant
-    int vr;            // variable of register
-    switch (root->kind) {
-        case ASSIGN:
-            vr = have_identifier(root->lhs);
-            if (vr == 0)
-                vr = root->lhs->val;
-            rv = codegen2(root->rhs);
-            is_rc = 0;
-            if (root->rhs->kind == CONSTANT)
-                is_rc = 1;
-            if (root->rhs->kind == LPAR && is_constant(root->rhs))
-                is_rc = 1;
-            if (is_rc == 1) {
-                for (int i = 0; i < NUM_REGISTERS; i++) {
-                    if (reg[i] == 0) {
-                        reg[i] = 1;
-                        r = i;
-                        break;
-                    }
-                }
-                printf("add r%d %d %d\n", r, 0, rv);
-                printf("store [%d] r%d\n", get_register_for_variable(vr), r);
-                reg[rv] = 0;
-                return r;
-            } else {
-                printf("store [%d] r%d\n", get_register_for_variable(vr), rv);
+// 重設 x, y, z 的暫存器描述，之後第一次讀取才會 load
+void init_registers() {
+    for (int i = 0; i < 3; i++)
+        var_vreg[i] = -1;
+}
+
+Operand new_vreg() {
+    Operand res = {OPND_REG, vreg_count++};
+    return res;
+}
+
+Operand imm(int val) {
+    Operand res = {OPND_IMM, val};
+    return res;
+}
+
+Operand mem(int addr) {
+    Operand res = {OPND_MEM, addr};
+    return res;
+}
+
+void emit(Opcode op, Operand dst, Operand src1, Operand src2) {
+    if (ir_len == ir_cap) {
+        ir_cap = ir_cap ? ir_cap * 2 : 64;
+        ir = (IRInst*)realloc(ir, sizeof(IRInst) * ir_cap);
+    }
+    ir[ir_len].op = op;
+    ir[ir_len].dst = dst;
+    ir[ir_len].src1 = src1;
+    ir[ir_len].src2 = src2;
+    ir[ir_len].stmt = cur_stmt;
+    ir_len++;
+}
+
+unsigned hash_value(Opcode op, Operand src1, Operand src2) {
+    unsigned h = (unsigned)op * 0x9E3779B1u;
+    h = (h ^ (unsigned)src1.kind) * 0x85EBCA77u ^ (unsigned)src1.val;
+    h = (h ^ (unsigned)src2.kind) * 0xC2B2AE3Du ^ (unsigned)src2.val;
+    return h ^ (h >> 16);
+}
+
+bool same_operand(Operand a, Operand b) {
+    return a.kind == b.kind && a.val == b.val;
+}
+
+// 在值編號表中找 (op, src1, src2)，找不到就回傳空位
+ValueEntry* find_value(Opcode op, Operand src1, Operand src2) {
+    unsigned mask = value_cap - 1;
+    for (unsigned i = hash_value(op, src1, src2) & mask;; i = (i + 1) & mask) {
+        ValueEntry* e = &values[i];
+        if (e->vreg == -1 || (e->op == op && same_operand(e->src1, src1) && same_operand(e->src2, src2)))
+            return e;
+    }
+}
+
+void grow_values() {
+    ValueEntry* old = values;
+    int old_cap = value_cap;
+    value_cap = value_cap ? value_cap * 2 : 256;
+    values = (ValueEntry*)malloc(sizeof(ValueEntry) * value_cap);
+    for (int i = 0; i < value_cap; i++)
+        values[i].vreg = -1;
+    for (int i = 0; i < old_cap; i++)
+        if (old[i].vreg != -1)
+            *find_value(old[i].op, old[i].src1, old[i].src2) = old[i];
+    free(old);
+}
+
+// 線性探測的刪除：把後面同一串裡原本該放在更前面的項目往回搬，找的時候才不會被空位擋住
+void remove_value(ValueEntry* e) {
+    unsigned mask = value_cap - 1, i = e - values, j = i;
+    values[i].vreg = -1;
+    while (values[j = (j + 1) & mask].vreg != -1) {
+        unsigned k = hash_value(values[j].op, values[j].src1, values[j].src2) & mask;
+        if (i <= j ? i < k && k <= j : i < k || k <= j)
+            continue;
+        values[i] = values[j];
+        values[j].vreg = -1;
+        i = j;
+    }
+    value_len--;
+}
+
+// 表裡超過 VALUE_WINDOW 個值時，照使用紀錄淘汰最久沒用到的；紀錄的時間和表中的不同表示之後又用過，跳過
+void evict_values() {
+    while (value_len > VALUE_WINDOW) {
+        ValueEntry rec = value_queue[value_head++];
+        ValueEntry* e = find_value(rec.op, rec.src1, rec.src2);
+        if (e->vreg != -1 && e->stamp == rec.stamp)
+            remove_value(e);
+    }
+    if (value_head > value_queue_len / 2) {
+        value_queue_len -= value_head;
+        memmove(value_queue, value_queue + value_head, sizeof(ValueEntry) * value_queue_len);
+        value_head = 0;
+    }
+}
+
+// 每個運算結果都放進新的虛擬暫存器，實體暫存器留到 allocate_registers() 再決定。
+// 虛擬暫存器只會被定義一次，變數被寫入時描述會換到新的虛擬暫存器，
+// 所以運算元的虛擬暫存器編號本身就是值編號，已經算過的運算直接沿用結果。
+// 表只留最近用到的 VALUE_WINDOW 個值，被淘汰的值之後會重新計算，跨敘述存活的值因此有上限。
+Operand emit_arith(Opcode op, Operand src1, Operand src2) {
+    if ((op == IR_ADD || op == IR_MUL) &&
+        (src1.kind > src2.kind || (src1.kind == src2.kind && src1.val > src2.val))) {  // 交換律
+        Operand tmp = src1;
+        src1 = src2;
+        src2 = tmp;
+    }
+    if (2 * (value_len + 1) > value_cap)
+        grow_values();
+    ValueEntry* e = find_value(op, src1, src2);
+    Operand dst = {OPND_REG, e->vreg};
+    if (e->vreg == -1) {
+        dst = new_vreg();
+        emit(op, dst, src1, src2);
+        e->op = op;
+        e->src1 = src1;
+        e->src2 = src2;
+        e->vreg = dst.val;
+        value_len++;
+    }
+    e->stamp = ++value_clock;
+    RESERVE(value_queue, value_queue_cap, value_queue_len + 1);
+    value_queue[value_queue_len++] = *e;
+    evict_values();
+    return dst;
+}
+
+Operand to_register(Operand opnd) {
+    if (opnd.kind == OPND_REG)
+        return opnd;
+    return emit_arith(IR_ADD, imm(0), opnd);
+}
+
+// ASMC 不接受負的立即數，負數要用 0 減出來
+Operand constant_operand(int val) {
+    if (val >= 0)
+        return imm(val);
+    if (val == -2147483647 - 1)
+        return emit_arith(IR_SUB, emit_arith(IR_SUB, imm(0), imm(2147483647)), imm(1));
+    return emit_arith(IR_SUB, imm(0), imm(-val));
+}
+
+Operand load_variable(char var) {
+    Operand res;
+    if (var_vreg[var - 'x'] != -1) {
+        res.kind = OPND_REG;
+        res.val = var_vreg[var - 'x'];
+        return res;
+    }
+    res = new_vreg();
+    emit(IR_LOAD, res, mem(get_register_for_variable(var)), (Operand){OPND_NONE, 0});
+    var_vreg[var - 'x'] = res.val;
+    return res;
+}
+
+// store 之後值還留在暫存器裡，描述改指向新的值即可
+void store_variable(char var, Operand opnd) {
+    opnd = to_register(opnd);
+    if (var_vreg[var - 'x'] == opnd.val)  // 值沒有改變，例如 x = x
+        return;
+    emit(IR_STORE, mem(get_register_for_variable(var)), opnd, (Operand){OPND_NONE, 0});
+    var_vreg[var - 'x'] = opnd.val;
+}
+
+// 在步數限制內找出用 add/sub 組出 target 倍的最短序列，找到就回傳步數，否則回傳 -1
+int find_mul_chain(unsigned target, ChainStep* chain) {
+    unsigned val[MAX_CHAIN + 2] = {0, 1};
+    int limit = (op_cost[IR_MUL] + const_cost((int)target) - 1) / op_cost[IR_ADD];  // 比 mul 便宜才值得
+    if (limit > MAX_CHAIN)
+        limit = MAX_CHAIN;
+    for (int len = 1; len <= limit; len++)
+        if (search_mul_chain(target, chain, val, 0, len))
+            return len;
+    return -1;
+}
+
+bool search_mul_chain(unsigned target, ChainStep* chain, unsigned* val, int depth, int len) {
+    if (depth == len)
+        return val[depth + 1] == target;
+    for (int op = IR_ADD; op <= IR_SUB; op++) {
+        for (int a = 0; a <= depth + 1; a++) {
+            for (int b = op == IR_ADD ? a : 0; b <= depth + 1; b++) {
+                val[depth + 2] = op == IR_ADD ? val[a] + val[b] : val[a] - val[b];
+                chain[depth].op = (Opcode)op;
+                chain[depth].a = a;
+                chain[depth].b = b;
+                if (search_mul_chain(target, chain, val, depth + 1, len))
+                    return true;
             }
-            break;
-        case ADD:
-            lv = codegen2(root->lhs);
-            rv = codegen2(root->rhs);
-            is_lc = 0;
-            is_rc = 0;
-            if (root->lhs->kind == CONSTANT)
-                is_lc = 1;
-            if (root->rhs->kind == CONSTANT)
-                is_rc = 1;
-            if (root->lhs->kind == LPAR && is_constant(root->lhs))
-                is_lc = 1;
-            if (root->rhs->kind == LPAR && is_constant(root->rhs))
-                is_rc = 1;
-            if ((is_lc == 0) & (is_rc == 0)) {
-                printf("add r%d r%d r%d\n", lv, lv, rv);
-                reg[rv] = 0;
-                return lv;
-            } else if ((is_lc == 0) & (is_rc == 1)) {
-                printf("add r%d r%d %d\n", lv, lv, rv);
-                return lv;
-            } else if ((is_lc == 1) & (is_rc == 0)) {
-                printf("add r%d %d r%d\n", rv, lv, rv);
-                return rv;
-            } else {
-                for (int i = 0; i < NUM_REGISTERS; i++) {
-                    if (reg[i] == 0) {
-                        reg[i] = 1;
-                        r = i;
-                        break;
-                    }
-                }
-                printf("add r%d %d %d\n", r, lv, rv);
-                return r;
+        }
+    }
+    return false;
+}
+
+// 序列執行時最多同時需要的暫存器數，和一條 mul 相比多出來的部分
+int mul_chain_extra_registers(ChainStep* chain, int len) {
+    int last_use[MAX_CHAIN + 2] = {0}, peak = 1;
+    for (int s = 0; s < len; s++)
+        last_use[chain[s].a] = last_use[chain[s].b] = s;
+    for (int s = 0; s < len; s++) {
+        int regs = 1;
+        for (int v = 1; v <= s + 1; v++)
+            if (last_use[v] > s)
+                regs++;
+        if (regs > peak)
+            peak = regs;
+    }
+    return peak - 1;
+}
+
+Operand emit_mul(Operand left, Operand right) {
+    if (left.kind == OPND_IMM && right.kind == OPND_REG)
+        return emit_mul_const(right, left.val);
+    if (left.kind == OPND_REG && right.kind == OPND_IMM)
+        return emit_mul_const(left, right.val);
+    return emit_arith(IR_MUL, left, right);
+}
+
+// 乘上常數時，依 op_cost 決定要用 mul 還是拆成 add/sub；k 可以是負的
+Operand emit_mul_const(Operand left, int k) {
+    ChainStep chain[MAX_CHAIN];
+    Operand val[MAX_CHAIN + 2];
+    if (left.kind == OPND_IMM)
+        return constant_operand((int)((unsigned)left.val * (unsigned)k));
+    if (k == 0 || k == 1)
+        return k ? left : imm(0);
+    int len = find_mul_chain((unsigned)k, chain);
+    if (len == -1)
+        return emit_arith(IR_MUL, left, constant_operand(k));
+    int resident = 0;
+    for (int i = 0; i < 3; i++)
+        resident += var_vreg[i] != -1;
+    if (mul_chain_extra_registers(chain, len) > 8 - pending_values - resident)  // r0-r7 不夠用就不拆
+        return emit_arith(IR_MUL, left, constant_operand(k));
+    val[0] = imm(0);
+    val[1] = left;
+    for (int s = 0; s < len; s++)
+        val[s + 2] = emit_arith(chain[s].op, val[chain[s].a], val[chain[s].b]);
+    return val[len + 1];
+}
+
+// 只含 + - * 和負號、沒有副作用、運算子不多的式子才交給超級最佳化
+bool superopt_candidate(int now, int* nodes, char* vars, int* nvars) {
+    switch (ast[now].kind) {
+        case IDENTIFIER:
+            if (strchr(vars, ast[now].val) == NULL) {
+                if (*nvars == SUPEROPT_MAX_INPUTS)
+                    return false;
+                vars[(*nvars)++] = (char)ast[now].val;
             }
-            break;
+            return true;
+        case CONSTANT:
+            return true;
+        case MINUS:
+            return ++*nodes <= SUPEROPT_MAX_NODES && superopt_candidate(ast[now].mid, nodes, vars, nvars);
+        case ADD:
         case SUB:
-            lv = codegen2(root->lhs);
-            rv = codegen2(root->rhs);
-            is_lc = 0;
-            is_rc = 0;
-            if (root->lhs->kind == CONSTANT)
-                is_lc = 1;
-            if (root->rhs->kind == CONSTANT)
-                is_rc = 1;
-            if ((is_lc == 0) & (is_rc == 0)) {
-                printf("sub r%d r%d r%d\n", lv, lv, rv);
-                reg[rv] = 0;
-                return lv;
-            } else if ((is_lc == 0) & (is_rc == 1)) {
-                printf("sub r%d r%d %d\n", lv, lv, rv);
-                return lv;
-            } else if ((is_lc == 1) & (is_rc == 0)) {
-                printf("sub r%d %d r%d\n", rv, lv, rv);
-                return rv;
-            } else {
-                for (int i = 0; i < NUM_REGISTERS; i++) {
-                    if (reg[i] == 0) {
-                        reg[i] = 1;
-                        r = i;
-                        break;
-                    }
-                }
-                printf("sub r%d %d %d\n", r, lv, rv);
-                return r;
-            }
-            break;
         case MUL:
-            lv = codegen2(root->lhs);
-            rv = codegen2(root->rhs);
-            is_lc = 0;
-            is_rc = 0;
-            if (root->lhs->kind == CONSTANT)
-                is_lc = 1;
-            if (root->rhs->kind == CONSTANT)
-                is_rc = 1;
-            if ((is_lc == 0) & (is_rc == 0)) {
-                printf("mul r%d r%d r%d\n", lv, lv, rv);
-                reg[rv] = 0;
-                return lv;
-            } else if ((is_lc == 0) & (is_rc == 1)) {
-                printf("mul r%d r%d %d\n", lv, lv, rv);
-                return lv;
-            } else if ((is_lc == 1) & (is_rc == 0)) {
-                printf("mul r%d %d r%d\n", rv, lv, rv);
-                return rv;
-            } else {
-                for (int i = 0; i < NUM_REGISTERS; i++) {
-                    if (reg[i] == 0) {
-                        reg[i] = 1;
-                        r = i;
-                        break;
-                    }
-                }
-                printf("mul r%d %d %d\n", r, lv, rv);
-                return r;
-            }
-            break;
-        case DIV:
-            lv = codegen2(root->lhs);
-            rv = codegen2(root->rhs);
-            is_lc = 0;
-            is_rc = 0;
-            if (root->lhs->kind == CONSTANT)
-                is_lc = 1;
-            if (root->rhs->kind == CONSTANT)
-                is_rc = 1;
-            if ((is_lc == 0) & (is_rc == 0)) {
-                if (lv != rv) {
-                    printf("div r%d r%d r%d\n", lv, lv, rv);
-                    reg[rv] = 0;
-                } else {
-                    printf("add r%d 0 1\n", lv);
-                }
-                return lv;
-            } else if ((is_lc == 0) & (is_rc == 1)) {
-                printf("div r%d r%d %d\n", lv, lv, rv);
-                return lv;
-            } else if ((is_lc == 1) & (is_rc == 0)) {
-                printf("div r%d %d r%d\n", rv, lv, rv);
-                return rv;
-            } else {
-                for (int i = 0; i < NUM_REGISTERS; i++) {
-                    if (reg[i] == 0) {
-                        reg[i] = 1;
-                        r = i;
-                        break;
-                    }
-                }
-                printf("div r%d %d %d\n", r, lv, rv);
-                return r;
-            }
-            break;
-        case REM:
-            lv = codegen2(root->lhs);
-            rv = codegen2(root->rhs);
-            is_lc = 0;
-            is_rc = 0;
-            if (root->lhs->kind == CONSTANT)
-                is_lc = 1;
-            if (root->rhs->kind == CONSTANT)
-                is_rc = 1;
-            if ((is_lc == 0) & (is_rc == 0)) {
-                if (lv != rv) {
-                    printf("rem r%d r%d r%d\n", lv, lv, rv);
-                    reg[rv] = 0;
-                } else {
-                    printf("add r%d 0 0\n", lv);
-                }
-                return lv;
-            } else if ((is_lc == 0) & (is_rc == 1)) {
-                printf("rem r%d r%d %d\n", lv, lv, rv);
-                return lv;
-            } else if ((is_lc == 1) & (is_rc == 0)) {
-                printf("rem r%d %d r%d\n", rv, lv, rv);
-                return rv;
-            } else {
-                for (int i = 0; i < NUM_REGISTERS; i++) {
-                    if (reg[i] == 0) {
-                        reg[i] = 1;
-                        r = i;
-                        break;
-                    }
-                }
-                printf("rem r%d %d %d\n", r, lv, rv);
-                return r;
-            }
-            break;
-        case PREINC:
-            rv = codegen2(root->mid);
-            vr = have_identifier(root->mid);
-            if (vr == 0)
-                vr = root->mid->val;
-            printf("add r%d r%d 1\n", rv, rv);
-            printf("store [%d] r%d\n", get_register_for_variable(vr), rv);
-            return rv;
+            return ++*nodes <= SUPEROPT_MAX_NODES && superopt_candidate(ast[now].lhs, nodes, vars, nvars) &&
+                   superopt_candidate(ast[now].rhs, nodes, vars, nvars);
+        default:
+            return false;
+    }
+}
+
+// 把變數依出現順序換成 a, b, c，當作資料庫的 key
+void superopt_key(int now, const char* vars, char* buf, size_t size) {
+    char lhs[SUPEROPT_KEY_LENGTH], rhs[SUPEROPT_KEY_LENGTH];
+    switch (ast[now].kind) {
+        case IDENTIFIER:
+            snprintf(buf, size, "%c", (char)('a' + (strchr(vars, ast[now].val) - vars)));
             break;
-        case PREDEC:
-            rv = codegen2(root->mid);
-            vr = have_identifier(root->mid);
-            if (vr == 0)
-                vr = root->mid->val;
-            printf("sub r%d r%d 1\n", rv, rv);
-            printf("store [%d] r%d\n", get_register_for_variable(vr), rv);
-            return rv;
+        case CONSTANT:
+            snprintf(buf, size, "%d", ast[now].val);
             break;
-        case POSTINC:
-            lv = codegen2(root->mid);
-            vr = have_identifier(root->mid);
-            if (vr == 0)
-                vr = root->mid->val;
-            for (int i = 0; i < NUM_REGISTERS; i++) {
-                if (reg[i] == 0) {
-                    reg[i] = 1;
-                    r = i;
-                    break;
-                }
-            }
-            printf("add r%d r%d 1\n", r, lv);
-            printf("store [%d] r%d\n", get_register_for_variable(vr), r);
-            reg[r] = 0;
-            return lv;
+        case MINUS:
+            superopt_key(ast[now].mid, vars, lhs, sizeof(lhs));
+            snprintf(buf, size, "-%s", lhs);
             break;
-        case POSTDEC:
-            lv = codegen2(root->mid);
-            vr = have_identifier(root->mid);
-            if (vr == 0)
-                vr = root->mid->val;
-            for (int i = 0; i < NUM_REGISTERS; i++) {
-                if (reg[i] == 0) {
-                    reg[i] = 1;
-                    r = i;
-                    break;
+        default:
+            superopt_key(ast[now].lhs, vars, lhs, sizeof(lhs));
+            superopt_key(ast[now].rhs, vars, rhs, sizeof(rhs));
+            snprintf(buf, size, "(%s%c%s)", lhs, "?+-*"[ast[now].kind], rhs);
+    }
+}
+
+// 用和 ASMC 相同的 32 位元繞回語意算出測試向量上的值
+unsigned superopt_eval(int now, const char* vars, const unsigned* in) {
+    switch (ast[now].kind) {
+        case IDENTIFIER:
+            return in[strchr(vars, ast[now].val) - vars];
+        case CONSTANT:
+            return (unsigned)ast[now].val;
+        case MINUS:
+            return 0u - superopt_eval(ast[now].mid, vars, in);
+        case ADD:
+            return superopt_eval(ast[now].lhs, vars, in) + superopt_eval(ast[now].rhs, vars, in);
+        case SUB:
+            return superopt_eval(ast[now].lhs, vars, in) - superopt_eval(ast[now].rhs, vars, in);
+        default:
+            return superopt_eval(ast[now].lhs, vars, in) * superopt_eval(ast[now].rhs, vars, in);
+    }
+}
+
+// 不經過超級最佳化時大概要花的 cycle，只有比它便宜的序列才會被採用
+int superopt_baseline(int now) {
+    ChainStep chain[MAX_CHAIN];
+    int len;
+    switch (ast[now].kind) {
+        case MINUS:
+            return op_cost[IR_SUB] + superopt_baseline(ast[now].mid);
+        case ADD:
+        case SUB:
+            return op_cost[IR_ADD] + superopt_baseline(ast[now].lhs) + superopt_baseline(ast[now].rhs);
+        case MUL:
+            len = -1;
+            if (ast[ast[now].rhs].kind == CONSTANT)
+                len = find_mul_chain((unsigned)ast[ast[now].rhs].val, chain);
+            else if (ast[ast[now].lhs].kind == CONSTANT)
+                len = find_mul_chain((unsigned)ast[ast[now].lhs].val, chain);
+            return (len == -1 ? op_cost[IR_MUL] : len * op_cost[IR_ADD]) + superopt_baseline(ast[now].lhs) +
+                   superopt_baseline(ast[now].rhs);
+        default:
+            return 0;
+    }
+}
+
+Poly poly_term(unsigned coef, int mono) {
+    Poly res;
+    res.len = coef != 0;
+    res.coef[0] = coef;
+    res.mono[0] = mono;
+    return res;
+}
+
+// 合併同類項並排序，兩個多項式在 mod 2^32 下相同若且唯若正規化後完全一樣
+void poly_normalize(Poly* p) {
+    for (int i = 1; i < p->len; i++)
+        for (int j = i; j > 0 && p->mono[j - 1] > p->mono[j]; j--) {
+            int m = p->mono[j];
+            unsigned c = p->coef[j];
+            p->mono[j] = p->mono[j - 1], p->coef[j] = p->coef[j - 1];
+            p->mono[j - 1] = m, p->coef[j - 1] = c;
+        }
+    int len = 0;
+    for (int i = 0; i < p->len; i++) {
+        if (len > 0 && p->mono[len - 1] == p->mono[i])
+            p->coef[len - 1] += p->coef[i];
+        else
+            p->mono[len] = p->mono[i], p->coef[len++] = p->coef[i];
+        if (p->coef[len - 1] == 0)
+            len--;
+    }
+    p->len = len;
+}
+
+// 項數超過 MAX_TERMS 時 len 設為 -1，代表無法驗證
+Poly poly_apply(Opcode op, Poly* a, Poly* b) {
+    Poly res;
+    res.len = 0;
+    if (a->len < 0 || b->len < 0) {
+        res.len = -1;
+        return res;
+    }
+    if (op == IR_MUL) {
+        for (int i = 0; i < a->len; i++)
+            for (int j = 0; j < b->len; j++) {
+                if (res.len == MAX_TERMS) {
+                    res.len = -1;
+                    return res;
                 }
+                res.coef[res.len] = a->coef[i] * b->coef[j];
+                res.mono[res.len++] = a->mono[i] + b->mono[j];  // 每個變數的次數各佔 4 個位元
             }
-            printf("sub r%d r%d 1\n", r, lv);
-            printf("store [%d] r%d\n", get_register_for_variable(vr), r);
-            reg[r] = 0;
-            return lv;
-            break;
+    } else {
+        if (a->len + b->len > MAX_TERMS) {
+            res.len = -1;
+            return res;
+        }
+        for (int i = 0; i < a->len; i++)
+            res.coef[res.len] = a->coef[i], res.mono[res.len++] = a->mono[i];
+        for (int i = 0; i < b->len; i++)
+            res.coef[res.len] = op == IR_ADD ? b->coef[i] : 0u - b->coef[i], res.mono[res.len++] = b->mono[i];
+    }
+    poly_normalize(&res);
+    return res;
+}
+
+Poly poly_of_ast(int now, const char* vars) {
+    Poly zero = poly_term(0, 0), lhs, rhs;
+    switch (ast[now].kind) {
         case IDENTIFIER:
-            for (int i = 0; i < NUM_REGISTERS; i++) {
-                if (reg[i] == 0) {
-                    reg[i] = 1;
-                    r = i;
-                    break;
+            return poly_term(1, 1 << (4 * (strchr(vars, ast[now].val) - vars)));
+        case CONSTANT:
+            return poly_term((unsigned)ast[now].val, 0);
+        case MINUS:
+            rhs = poly_of_ast(ast[now].mid, vars);
+            return poly_apply(IR_SUB, &zero, &rhs);
+        default:
+            lhs = poly_of_ast(ast[now].lhs, vars);
+            rhs = poly_of_ast(ast[now].rhs, vars);
+            return poly_apply((Opcode)(ast[now].kind - ADD + IR_ADD), &lhs, &rhs);
+    }
+}
+
+// 測試向量都通過之後，再把候選序列展開成多項式和目標比對，確定在所有輸入下都相等
+bool superopt_verify(SuperSearch* s, int len) {
+    Poly val[SUPEROPT_MAX_INPUTS + SUPEROPT_MAX_IMM + SUPEROPT_MAX_LEN];
+    for (int i = 0; i < s->nin; i++)
+        val[i] = poly_term(1, 1 << (4 * i));
+    for (int i = 0; i < s->nimm; i++)
+        val[s->nin + i] = poly_term(s->imm[i], 0);
+    for (int k = 0; k < len; k++)
+        val[s->nin + s->nimm + k] = poly_apply(s->step[k].op, &val[s->step[k].a], &val[s->step[k].b]);
+    Poly* res = &val[s->nin + s->nimm + len - 1];
+    if (res->len < 0 || res->len != s->goal.len)
+        return false;
+    for (int i = 0; i < res->len; i++)
+        if (res->mono[i] != s->goal.mono[i] || res->coef[i] != s->goal.coef[i])
+            return false;
+    return true;
+}
+
+// 分支界限搜尋：依序列舉每一步的運算和兩個運算元，超過目前最佳 cycle 就剪掉
+void superopt_search(SuperSearch* s, int depth, int cost) {
+    int n = s->nin + s->nimm + depth;
+    if (s->budget-- <= 0)
+        return;
+    if (depth > 0) {
+        bool match = true;
+        for (int t = 0; t < NUM_VECTORS && match; t++)
+            match = s->val[n - 1][t] == s->target[t];
+        if (match && superopt_verify(s, depth)) {
+            s->best_cost = cost;
+            s->best_len = depth;
+            memcpy(s->best, s->step, sizeof(ChainStep) * depth);
+            return;
+        }
+    }
+    if (depth == SUPEROPT_MAX_LEN)
+        return;
+    for (int op = IR_ADD; op <= IR_MUL; op++) {
+        if (cost + op_cost[op] >= s->best_cost)
+            continue;
+        for (int a = 0; a < n; a++) {
+            for (int b = op == IR_SUB ? 0 : a; b < n; b++) {
+                bool a_imm = a >= s->nin && a < s->nin + s->nimm, b_imm = b >= s->nin && b < s->nin + s->nimm;
+                if (a_imm && b_imm)  // 兩個立即數可以直接算出來
+                    continue;
+                for (int t = 0; t < NUM_VECTORS; t++) {
+                    unsigned x = s->val[a][t], y = s->val[b][t];
+                    s->val[n][t] = op == IR_ADD ? x + y : op == IR_SUB ? x - y : x * y;
                 }
+                s->step[depth].op = (Opcode)op;
+                s->step[depth].a = a;
+                s->step[depth].b = b;
+                superopt_search(s, depth + 1, cost + op_cost[op]);
             }
-            printf("load r%d [%d]\n", r, get_register_for_variable(root->val));
-            return r;
-            break;
+        }
+    }
+}
+
+void superopt_add_imm(SuperSearch* s, int val) {
+    unsigned v = val < 0 ? 0u - (unsigned)val : (unsigned)val;
+    if ((int)v < 0)
+        return;
+    for (int i = 0; i < s->nimm; i++)
+        if (s->imm[i] == v)
+            return;
+    if (s->nimm < SUPEROPT_MAX_IMM)
+        s->imm[s->nimm++] = v;
+}
+
+void superopt_collect_imm(SuperSearch* s, int now) {
+    if (now == NIL)
+        return;
+    if (ast[now].kind == CONSTANT)
+        superopt_add_imm(s, ast[now].val);
+    superopt_collect_imm(s, ast[now].lhs);
+    superopt_collect_imm(s, ast[now].mid);
+    superopt_collect_imm(s, ast[now].rhs);
+}
+
+// 搜尋結果存成 "add i0 i1,mul t0 5" 的形式：i 是輸入，t 是前面步驟的結果；"-" 表示沒有更好的序列
+void superopt_encode(SuperSearch* s, char* buf, size_t size) {
+    const static char OpName[][4] = {"add", "sub", "mul"};
+    if (s->best_len == 0) {
+        snprintf(buf, size, "-");
+        return;
+    }
+    size_t pos = 0;
+    for (int k = 0; k < s->best_len; k++) {
+        int opnd[2] = {s->best[k].a, s->best[k].b};
+        pos += snprintf(buf + pos, size - pos, "%s%s", k ? "," : "", OpName[s->best[k].op]);
+        for (int j = 0; j < 2; j++) {
+            if (opnd[j] < s->nin)
+                pos += snprintf(buf + pos, size - pos, " i%d", opnd[j]);
+            else if (opnd[j] < s->nin + s->nimm)
+                pos += snprintf(buf + pos, size - pos, " %u", s->imm[opnd[j] - s->nin]);
+            else
+                pos += snprintf(buf + pos, size - pos, " t%d", opnd[j] - s->nin - s->nimm);
+        }
+    }
+}
+
+unsigned hash_string(const char* str) {
+    unsigned h = 2166136261u;
+    for (; *str; str++)
+        h = (h ^ (unsigned char)*str) * 16777619u;
+    return h;
+}
+
+SuperEntry* superopt_find(const char* key) {
+    unsigned mask = superopt_cap - 1;
+    for (unsigned i = hash_string(key) & mask;; i = (i + 1) & mask)
+        if (superopt_table[i].key == NULL || !strcmp(superopt_table[i].key, key))
+            return &superopt_table[i];
+}
+
+void superopt_insert(const char* key, const char* prog) {
+    if (2 * (superopt_len + 1) > superopt_cap) {
+        SuperEntry* old = superopt_table;
+        int old_cap = superopt_cap;
+        superopt_cap *= 2;
+        superopt_table = (SuperEntry*)calloc(superopt_cap, sizeof(SuperEntry));
+        for (int i = 0; i < old_cap; i++)
+            if (old[i].key != NULL)
+                *superopt_find(old[i].key) = old[i];
+        free(old);
+    }
+    SuperEntry* e = superopt_find(key);
+    if (e->key != NULL)
+        return;
+    e->key = (char*)malloc(strlen(key) + 1);
+    e->prog = (char*)malloc(strlen(prog) + 1);
+    strcpy(e->key, key);
+    strcpy(e->prog, prog);
+    superopt_len++;
+}
+
+// 第一次用到時把磁碟上的結果讀進雜湊表，之後查詢都是 O(1)；沒設 SUPEROPT_DB 時只用這次編譯找到的結果
+void superopt_load() {
+    char line[2 * SUPEROPT_KEY_LENGTH];
+    superopt_loaded = true;
+    superopt_cap = 256;
+    superopt_table = (SuperEntry*)calloc(superopt_cap, sizeof(SuperEntry));
+    const char* path = getenv("SUPEROPT_DB");
+    FILE* file = path != NULL ? fopen(path, "r") : NULL;
+    if (file == NULL)
+        return;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char* tab = strchr(line, '\t');
+        if (tab == NULL)
+            continue;
+        *tab = '\0';
+        tab[strcspn(tab + 1, "\n") + 1] = '\0';
+        superopt_insert(line, tab + 1);
+    }
+    fclose(file);
+}
+
+// 只存找到的序列；沒找到可能只是搜尋的節點數用完了，下次還值得再找
+void superopt_save(const char* key, const char* prog) {
+    const char* path = getenv("SUPEROPT_DB");
+    FILE* file = path != NULL && prog[0] != '-' ? fopen(path, "a") : NULL;
+    if (file == NULL)  // 沒辦法寫入就只留在記憶體中
+        return;
+    fprintf(file, "%s\t%s\n", key, prog);
+    fclose(file);
+}
+
+// 找出（或從資料庫查到）比一般產生方式更便宜的指令序列，有的話直接產生並回傳結果
+bool superoptimize(int now, Operand* res) {
+    char vars[SUPEROPT_MAX_INPUTS + 1] = {0}, key[SUPEROPT_KEY_LENGTH], prog[SUPEROPT_KEY_LENGTH];
+    int nodes = 0, nvars = 0;
+    if (!superopt_candidate(now, &nodes, vars, &nvars) || nodes < 2 || nvars == 0)
+        return false;
+    if (!superopt_loaded)
+        superopt_load();
+    superopt_key(now, vars, key, sizeof(key));
+    SuperEntry* e = superopt_find(key);
+    if (e->key != NULL) {
+        snprintf(prog, sizeof(prog), "%s", e->prog);
+    } else if (superopt_steps <= 0) {
+        return false;
+    } else {
+        SuperSearch s;
+        s.nin = nvars;
+        s.nimm = 0;
+        superopt_add_imm(&s, 0);
+        superopt_add_imm(&s, 1);
+        superopt_collect_imm(&s, now);
+        superopt_add_imm(&s, 2);
+        for (int t = 0; t < NUM_VECTORS; t++) {
+            unsigned in[SUPEROPT_MAX_INPUTS];
+            for (int i = 0; i < SUPEROPT_MAX_INPUTS; i++)
+                in[i] = superopt_vectors[t][i];
+            for (int i = 0; i < s.nin; i++)
+                s.val[i][t] = in[i];
+            for (int i = 0; i < s.nimm; i++)
+                s.val[s.nin + i][t] = s.imm[i];
+            s.target[t] = superopt_eval(now, vars, in);
+        }
+        s.goal = poly_of_ast(now, vars);
+        if (s.goal.len < 0)
+            return false;
+        s.best_cost = superopt_baseline(now);
+        s.best_len = 0;
+        s.budget = superopt_steps < SUPEROPT_BUDGET ? superopt_steps : SUPEROPT_BUDGET;
+        superopt_steps -= s.budget;
+        superopt_search(&s, 0, 0);
+        if (s.budget > 0)  // 沒用完的還回去
+            superopt_steps += s.budget;
+        superopt_encode(&s, prog, sizeof(prog));
+        superopt_insert(key, prog);
+        superopt_save(key, prog);
+    }
+    if (prog[0] == '-')
+        return false;
+    // 照著序列產生指令，輸入就是目前變數所在的暫存器
+    Operand val[SUPEROPT_MAX_LEN];
+    char* step = prog;
+    int len = 0;
+    while (step != NULL && *step) {
+        char name[4], opnd[2][16];
+        Operand src[2];
+        sscanf(step, "%3s %15s %15s", name, opnd[0], opnd[1]);
+        for (int j = 0; j < 2; j++) {
+            if (opnd[j][0] == 'i')
+                src[j] = load_variable(vars[atoi(opnd[j] + 1)]);
+            else if (opnd[j][0] == 't')
+                src[j] = val[atoi(opnd[j] + 1)];
+            else
+                src[j] = imm(atoi(opnd[j]));
+        }
+        Opcode op = !strcmp(name, "add") ? IR_ADD : !strcmp(name, "sub") ? IR_SUB : IR_MUL;
+        val[len++] = op == IR_MUL ? emit_mul(src[0], src[1]) : emit_arith(op, src[0], src[1]);
+        step = strchr(step, ',');
+        if (step != NULL)
+            step++;
+    }
+    *res = val[len - 1];
+    return true;
+}
+
+int const_value(int val, Mode mode) {
+    return mode == MODE_VAL ? val : (int)(0u - (unsigned)val);
+}
+
+// 常數當運算元的代價：非負的直接當立即數，負的要先用 sub 從 0 減出來
+int const_cost(int val) {
+    if (val >= 0)
+        return 0;
+    return val == -2147483647 - 1 ? 2 * op_cost[IR_SUB] : op_cost[IR_SUB];
+}
+
+// 乘上常數 k 的代價：拆成 add/sub 或是一條 mul（k 為負時還要先產生常數）
+int mul_const_cost(int k) {
+    ChainStep chain[MAX_CHAIN];
+    int len = find_mul_chain((unsigned)k, chain);
+    if (k == 0 || k == 1)
+        return 0;
+    if (len != -1)
+        return len * op_cost[IR_ADD];
+    return op_cost[IR_MUL] + const_cost(k);
+}
+
+// BURS：每個節點分別算出「要它的值」和「要它的相反數」時最便宜的覆蓋方式。
+// 負號可以被 add/sub 互換、交換運算元或 mul/div 的兩個負號抵消吸收，吸收不掉才補一條 sub 0。
+// 節點已經照後序排好，照編號掃過去時子節點一定已經算完
+void select_tiles(int first, int root) {
+    for (int now = first; now <= root; now++)
+        select_tile(now);
+}
+
+void select_tile(int now) {
+    int penalty = ast[now].need > 8 ? 2 : 1;  // 大概會用到 r8 以後的暫存器
+    int negate = op_cost[IR_SUB] * penalty;
+    Tile* t = ast[now].tile;
+    for (int m = MODE_VAL; m <= MODE_NEG; m++) {
+        t[m].cost = 0;
+        t[m].lmode = t[m].rmode = MODE_VAL;
+        t[m].swap = t[m].negate = false;
+    }
+    switch (ast[now].kind) {
         case CONSTANT:
-            return root->val;
-            break;
+            t[MODE_VAL].cost = const_cost(ast[now].val);
+            t[MODE_NEG].cost = const_cost(const_value(ast[now].val, MODE_NEG));
+            return;
+        case MINUS:
         case PLUS:
-            lv = codegen2(root->mid);
-            return lv;
+        case LPAR:
+            for (int m = MODE_VAL; m <= MODE_NEG; m++)
+                t[m].cost = ast[ast[now].mid].tile[ast[now].kind == MINUS ? !m : m].cost;
+            return;
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case REM:
             break;
-        case MINUS:
-            lv = codegen2(root->mid);
-            is_lc = 0;
-            if (root->mid->kind == CONSTANT)
-                is_lc = 1;
-            if (root->mid->kind == LPAR && is_constant(root->mid))
-                is_lc = 1;
-            if ((is_lc == 1)) {
-                for (int i = 0; i < NUM_REGISTERS; i++) {
-                    if (reg[i] == 0) {
-                        reg[i] = 1;
-                        r = i;
-                        break;
+        default:  // 變數和有副作用的運算只能先拿到值
+            if (ast[now].kind == ASSIGN) {
+                AST* r = &ast[ast[now].rhs];
+                t[MODE_VAL].cost = r->tile[MODE_VAL].cost + (r->kind == CONSTANT) * op_cost[IR_ADD];
+            } else if (ast[now].kind != IDENTIFIER)
+                t[MODE_VAL].cost = op_cost[IR_ADD] * penalty;
+            t[MODE_NEG].cost = t[MODE_VAL].cost + negate;
+            t[MODE_NEG].negate = true;
+            return;
+    }
+    AST *l = &ast[ast[now].lhs], *r = &ast[ast[now].rhs];
+    for (int m = MODE_VAL; m <= MODE_NEG; m++)
+        t[m].cost = -1;
+    for (int i = 0; i < (int)(sizeof(tile_rules) / sizeof(tile_rules[0])); i++) {
+        const TileRule* rule = &tile_rules[i];
+        if (rule->kind != ast[now].kind)
+            continue;
+        if (rule->const_rhs && (r->kind != CONSTANT || r->val == 1 || r->val == -2147483647 - 1))
+            continue;
+        int cost = l->tile[rule->lmode].cost + r->tile[rule->rmode].cost;
+        if (ast[now].kind == MUL && r->kind == CONSTANT)
+            cost = l->tile[rule->lmode].cost + mul_const_cost(const_value(r->val, rule->rmode)) * penalty;
+        else if (ast[now].kind == MUL && l->kind == CONSTANT)
+            cost = r->tile[rule->rmode].cost + mul_const_cost(const_value(l->val, rule->lmode)) * penalty;
+        else
+            cost += op_cost[rule->op] * penalty;
+        for (Mode m = MODE_VAL; m <= MODE_NEG; m++) {
+            int total = cost + (rule->sign != m) * negate;
+            if (t[m].cost == -1 || total < t[m].cost) {
+                t[m].cost = total;
+                t[m].lmode = rule->lmode;
+                t[m].rmode = rule->rmode;
+                t[m].op = rule->op;
+                t[m].swap = rule->swap;
+                t[m].negate = rule->sign != m;
+            }
+        }
+    }
+}
+
+// 用 heap 上的堆疊代替遞迴，越深的巢狀也不會用到更多 stack；子節點的結果經由 ret 交回上一層
+Operand codegen(int root, Mode mode) {
+    static CodegenFrame* frames = NULL;
+    static int frame_cap = 0;
+    int top = 0;
+    Operand ret, res;
+    RESERVE(frames, frame_cap, 1);
+    frames[top++] = (CodegenFrame){.now = root, .mode = mode};
+    while (top > 0) {
+        RESERVE(frames, frame_cap, top + 1);
+        CodegenFrame* f = &frames[top - 1];
+        int now = f->now, l = ast[now].lhs, r = ast[now].rhs;
+        Tile* tile = &ast[now].tile[f->mode];
+        char vr;
+        if (f->stage == 1 && ast[now].kind == ASSIGN) {
+            res = to_register(ret);
+            store_variable((char)get_node_info(l).val, res);
+        } else if (f->stage == 1 && ast[now].kind == MUL && (ast[r].kind == CONSTANT || ast[l].kind == CONSTANT)) {
+            if (ast[r].kind == CONSTANT)
+                res = emit_mul_const(ret, const_value(ast[r].val, tile->rmode));
+            else
+                res = emit_mul_const(ret, const_value(ast[l].val, tile->lmode));
+            ret = tile->negate ? emit_arith(IR_SUB, imm(0), res) : res;
+            top--;
+            continue;
+        } else if (f->stage == 1) {
+            f->first = ret;
+            f->stage = 2;
+            pending_values++;  // 算另一邊時先算好的結果還要佔著一個暫存器
+            frames[top++] = f->rhs_first ? (CodegenFrame){.now = l, .mode = tile->lmode}
+                                         : (CodegenFrame){.now = r, .mode = tile->rmode};
+            continue;
+        } else if (f->stage == 2) {
+            Operand left = f->rhs_first ? ret : f->first, right = f->rhs_first ? f->first : ret;
+            pending_values--;
+            res = tile->swap ? emit_arith(tile->op, right, left) : emit_arith(tile->op, left, right);
+            ret = tile->negate ? emit_arith(IR_SUB, imm(0), res) : res;
+            top--;
+            continue;
+        } else if (!superoptimize(now, &res))
+            switch (ast[now].kind) {
+                case ASSIGN:
+                    f->stage = 1;
+                    frames[top++] = (CodegenFrame){.now = r, .mode = MODE_VAL};
+                    continue;
+                case ADD:
+                case SUB:
+                case MUL:
+                case DIV:
+                case REM:
+                    f->stage = 1;
+                    if (ast[now].kind == MUL && ast[r].kind == CONSTANT)  // 常數交給 emit_mul_const() 決定怎麼乘
+                        frames[top++] = (CodegenFrame){.now = l, .mode = tile->lmode};
+                    else if (ast[now].kind == MUL && ast[l].kind == CONSTANT)
+                        frames[top++] = (CodegenFrame){.now = r, .mode = tile->rmode};
+                    else {
+                        // 先算需要較多暫存器的一邊；兩邊都有副作用時維持原本的順序
+                        f->rhs_first = ast[r].need > ast[l].need && !(has_side_effect(l) && has_side_effect(r));
+                        frames[top++] = f->rhs_first ? (CodegenFrame){.now = r, .mode = tile->rmode}
+                                                     : (CodegenFrame){.now = l, .mode = tile->lmode};
                     }
-                }
-                printf("sub r%d 0 %d\n", r, lv);
-                return r;
-            } else {
-                printf("sub r%d 0 r%d\n", lv, lv);
-                return lv;
+                    continue;
+                case PREINC:
+                case PREDEC:
+                    vr = (char)get_node_info(ast[now].mid).val;
+                    res = emit_arith(ast[now].kind == PREINC ? IR_ADD : IR_SUB, load_variable(vr), imm(1));
+                    store_variable(vr, res);
+                    break;
+                case POSTINC:
+                case POSTDEC:
+                    vr = (char)get_node_info(ast[now].mid).val;
+                    res = load_variable(vr);  // 舊值仍留在原本的虛擬暫存器
+                    store_variable(vr, emit_arith(ast[now].kind == POSTINC ? IR_ADD : IR_SUB, res, imm(1)));
+                    break;
+                case IDENTIFIER:
+                    res = load_variable((char)ast[now].val);
+                    break;
+                case CONSTANT:
+                    ret = constant_operand(const_value(ast[now].val, f->mode));
+                    top--;
+                    continue;
+                case PLUS:
+                case LPAR:
+                case RPAR:
+                    f->now = ast[now].mid;  // 直接換成子節點，不用多佔一層
+                    continue;
+                case MINUS:
+                    f->now = ast[now].mid;
+                    f->mode = f->mode == MODE_VAL ? MODE_NEG : MODE_VAL;
+                    continue;
+                default:
+                    err("Unexpected AST node during code generation.");
             }
+        ret = f->mode == MODE_VAL ? res : emit_arith(IR_SUB, imm(0), res);
+        top--;
+    }
+    return ret;
+}
+
+// ASMC 只在程式結束時檢查記憶體，同一個位址只需要保留最後一次 store
+void remove_dead_stores() {
+    bool stored[256] = {false};
+    int len = ir_len;
+    ir_len = 0;
+    for (int i = len - 1; i >= 0; i--) {
+        if (ir[i].op == IR_STORE) {
+            if (stored[ir[i].dst.val])
+                ir[i].op = IR_NOP;
+            stored[ir[i].dst.val] = true;
+        }
+    }
+    for (int i = 0; i < len; i++)
+        if (ir[i].op != IR_NOP)
+            ir[ir_len++] = ir[i];
+}
+
+// 刪掉結果沒有被用到的指令，例如沒有賦值的敘述或被覆蓋掉的 store 的運算
+void remove_dead_code() {
+    bool* used = (bool*)calloc(vreg_count + 1, sizeof(bool));
+    int len = ir_len;
+    ir_len = 0;
+    for (int i = len - 1; i >= 0; i--) {
+        if (ir[i].op != IR_STORE && !used[ir[i].dst.val]) {
+            ir[i].op = IR_NOP;
+            continue;
+        }
+        if (ir[i].src1.kind == OPND_REG)
+            used[ir[i].src1.val] = true;
+        if (ir[i].src2.kind == OPND_REG)
+            used[ir[i].src2.val] = true;
+    }
+    for (int i = 0; i < len; i++)
+        if (ir[i].op != IR_NOP)
+            ir[ir_len++] = ir[i];
+    free(used);
+}
+
+// 依照使用次數和指令 cycle 計算每個虛擬暫存器的權重，越常用的越要放進 r0-r7
+void build_live_ranges() {
+    live = (LiveRange*)realloc(live, sizeof(LiveRange) * (vreg_count + 1));
+    for (int v = 0; v < vreg_count; v++) {
+        live[v].def = live[v].last_use = -1;
+        live[v].weight = 0;
+        live[v].adj = NULL;
+        live[v].deg = live[v].cap = 0;
+    }
+    for (int i = 0; i < ir_len; i++) {
+        Operand opnd[3] = {ir[i].dst, ir[i].src1, ir[i].src2};
+        for (int j = 0; j < 3; j++) {
+            if (opnd[j].kind != OPND_REG)
+                continue;
+            if (j == 0)
+                live[opnd[j].val].def = i;
+            else
+                live[opnd[j].val].last_use = i;
+            live[opnd[j].val].weight += op_cost[ir[i].op];
+        }
+    }
+}
+
+void add_interference(int a, int b) {
+    LiveRange* r[2] = {&live[a], &live[b]};
+    int other[2] = {b, a};
+    for (int k = 0; k < 2; k++) {
+        if (r[k]->deg == r[k]->cap) {
+            r[k]->cap = r[k]->cap ? r[k]->cap * 2 : 8;
+            r[k]->adj = (int*)realloc(r[k]->adj, sizeof(int) * r[k]->cap);
+        }
+        r[k]->adj[r[k]->deg++] = other[k];
+    }
+}
+
+// 直線程式中，兩個值的存活區間 (def, last_use] 重疊就互相干擾。
+// 在 last_use 那行定義的值可以沿用同一個暫存器，因為 ASMC 先讀來源再寫目的地。
+void build_interference_graph() {
+    int* active = (int*)malloc(sizeof(int) * (vreg_count + 1));
+    int active_len = 0;
+    for (int i = 0; i < ir_len; i++) {
+        if (ir[i].dst.kind != OPND_REG)
+            continue;
+        int v = ir[i].dst.val, len = 0;
+        for (int j = 0; j < active_len; j++)
+            if (live[active[j]].last_use > i)
+                active[len++] = active[j];
+        active_len = len;
+        for (int j = 0; j < active_len; j++)
+            add_interference(v, active[j]);
+        active[active_len++] = v;
+    }
+    free(active);
+}
+
+int cmp_weight(const void* a, const void* b) {
+    const LiveRange *ra = &live[*(const int*)a], *rb = &live[*(const int*)b];
+    if (no_spill[*(const int*)a] != no_spill[*(const int*)b])
+        return no_spill[*(const int*)b] - no_spill[*(const int*)a];
+    if (ra->weight != rb->weight)
+        return rb->weight - ra->weight;
+    return (ra->last_use - ra->def) - (rb->last_use - rb->def);  // 一樣熱的話，短的先拿
+}
+
+// 權重高的先著色，每個都拿鄰居沒用到的最小編號，r8 以後只留給最冷的值。
+// 256 個都被鄰居佔走的值交給 spill_registers() 改寫中間碼，再重新著色一次；
+// 改寫產生的值存活區間只有一兩行而且最先著色，所以每一輪都會減少要溢出的值，最後一定著得完。
+void allocate_registers() {
+    no_spill = (bool*)calloc(vreg_count + 1, sizeof(bool));
+    no_spill_cap = vreg_count + 1;
+    while (true) {
+        build_live_ranges();
+        build_interference_graph();
+        int* order = (int*)malloc(sizeof(int) * (vreg_count + 1));
+        int n = 0, failed = 0, count = vreg_count;  // spill_registers() 新增的值還沒有存活區間
+        phys = (int*)realloc(phys, sizeof(int) * (vreg_count + 1));
+        for (int v = 0; v < vreg_count; v++) {
+            phys[v] = -1;
+            if (live[v].def != -1)
+                order[n++] = v;
+        }
+        qsort(order, n, sizeof(int), cmp_weight);
+        for (int k = 0; k < n; k++) {
+            bool taken[NUM_REGISTERS] = {false};
+            int v = order[k], r = 0;
+            for (int j = 0; j < live[v].deg; j++)
+                if (phys[live[v].adj[j]] != -1)
+                    taken[phys[live[v].adj[j]]] = true;
+            while (r < NUM_REGISTERS && taken[r])
+                r++;
+            if (r == NUM_REGISTERS)
+                order[failed++] = v;  // 已經看過的位置可以拿來放著不了色的值
+            else
+                phys[v] = r;
+        }
+        if (failed > 0)
+            spill_registers(order, failed);
+        for (int v = 0; v < count; v++)
+            free(live[v].adj);
+        free(order);
+        if (failed == 0)
             break;
-        case LPAR:
-            return codegen2(root->mid);
+    }
+    assign_spill_slots();
+}
+
+// 改寫中間碼，讓 spilled 裡的值不再佔著暫存器。只由兩個立即數算出來的常數，和之後沒被 store 蓋掉的 load，
+// 直接在每次使用前重新算一次；其他的值算完馬上 store 到一個溢出位置，每次使用前再 load 回來
+void spill_registers(int* spilled, int n) {
+    int count = vreg_count, *mode = (int*)malloc(sizeof(int) * count);  // -1 不用溢出，-2 重新計算，否則是溢出位置
+    int* clobber = (int*)malloc(sizeof(int) * (ir_len + 1));  // load 之後第一次 store 到同一個位址的位置
+    int next_store[MEMORY_SIZE];
+    IRInst* out = NULL;
+    int out_len = 0, out_cap = 0;
+    for (int a = 0; a < MEMORY_SIZE; a++)
+        next_store[a] = ir_len;
+    for (int i = ir_len - 1; i >= 0; i--) {
+        if (ir[i].op == IR_STORE && ir[i].dst.val < MEMORY_SIZE)
+            next_store[ir[i].dst.val] = i;
+        if (ir[i].op == IR_LOAD)
+            clobber[i] = ir[i].src1.val < MEMORY_SIZE ? next_store[ir[i].src1.val] : ir_len;
+    }
+    for (int v = 0; v < count; v++)
+        mode[v] = -1;
+    for (int k = 0; k < n; k++) {
+        int v = spilled[k];
+        IRInst* def = &ir[live[v].def];
+        if ((def->op == IR_ADD || def->op == IR_SUB) && def->src1.kind == OPND_IMM && def->src2.kind == OPND_IMM)
+            mode[v] = -2;
+        else if (def->op == IR_LOAD && clobber[live[v].def] > live[v].last_use)
+            mode[v] = -2;
+        else
+            mode[v] = MEMORY_SIZE + spill_count++;
+    }
+    for (int i = 0; i < ir_len; i++) {
+        IRInst inst = ir[i];
+        Operand* src[2] = {&inst.src1, &inst.src2};
+        if (inst.dst.kind == OPND_REG && mode[inst.dst.val] == -2)
+            continue;  // 每次使用前才算
+        for (int j = 0; j < 2; j++) {
+            int v = src[j]->val;
+            if (src[j]->kind != OPND_REG || v >= count || mode[v] == -1)
+                continue;  // v >= count 是前一個來源剛換上的值
+            Operand t = new_vreg();
+            RESERVE(no_spill, no_spill_cap, vreg_count);
+            no_spill[t.val] = true;
+            RESERVE(out, out_cap, out_len + 1);
+            if (mode[v] == -2)
+                out[out_len] = ir[live[v].def];
+            else
+                out[out_len] = (IRInst){IR_LOAD, t, mem(mode[v]), {OPND_NONE, 0}, inst.stmt};
+            out[out_len++].dst = t;
+            if (j == 0 && same_operand(inst.src1, inst.src2))
+                inst.src2 = t;
+            *src[j] = t;
+        }
+        RESERVE(out, out_cap, out_len + 2);
+        out[out_len++] = inst;
+        if (inst.dst.kind == OPND_REG && mode[inst.dst.val] >= 0) {
+            out[out_len++] = (IRInst){IR_STORE, mem(mode[inst.dst.val]), inst.dst, {OPND_NONE, 0}, inst.stmt};
+            no_spill[inst.dst.val] = true;
+        }
+    }
+    free(ir);
+    ir = out;
+    ir_len = out_len;
+    ir_cap = out_cap;
+    free(mode);
+    free(clobber);
+}
+
+// 溢出位置的存活區間是第一次 store 到最後一次 load，照順序掃過去，用完的位址馬上給下一個
+void assign_spill_slots() {
+    int *last = (int*)malloc(sizeof(int) * (spill_count + 1)), *addr = (int*)malloc(sizeof(int) * (spill_count + 1));
+    int free_addr[MEMORY_SIZE / 4], nfree = 0;
+    for (int a = MEMORY_SIZE - 4; a >= SPILL_BASE; a -= 4)
+        free_addr[nfree++] = a;
+    for (int i = 0; i < ir_len; i++)
+        if (ir[i].op == IR_LOAD && ir[i].src1.val >= MEMORY_SIZE)
+            last[ir[i].src1.val - MEMORY_SIZE] = i;
+    for (int i = 0; i < ir_len; i++) {
+        if (ir[i].op == IR_STORE && ir[i].dst.val >= MEMORY_SIZE) {
+            if (nfree == 0)
+                err("No available memory for spilling.");
+            addr[ir[i].dst.val - MEMORY_SIZE] = free_addr[--nfree];
+            ir[i].dst.val = addr[ir[i].dst.val - MEMORY_SIZE];
+        } else if (ir[i].op == IR_LOAD && ir[i].src1.val >= MEMORY_SIZE) {
+            int slot = ir[i].src1.val - MEMORY_SIZE;
+            ir[i].src1.val = addr[slot];
+            if (last[slot] == i)
+                free_addr[nfree++] = addr[slot];
+        }
+    }
+    free(last);
+    free(addr);
+}
+
+void print_operand(Operand opnd) {
+    switch (opnd.kind) {
+        case OPND_REG:
+            printf("r%d", phys[opnd.val]);
             break;
-        case RPAR:
-            return codegen2(root->mid);
+        case OPND_IMM:
+            printf("%d", opnd.val);
+            break;
+        case OPND_MEM:
+            printf("[%d]", opnd.val);
             break;
         default:
             break;
     }
-    return 0;
 }
-//
 
-void freeAST(AST* now) {
-    if (now == NULL)
-        return;
-    freeAST(now->lhs);
-    freeAST(now->mid);
-    freeAST(now->rhs);
-    free(now);
+void print_program() {
+    const static char OpName[][8] = {"add", "sub", "mul", "div", "rem", "load", "store"};
+    for (int i = 0; i < ir_len; i++) {
+        printf("%s ", OpName[ir[i].op]);
+        print_operand(ir[i].dst);
+        putchar(' ');
+        print_operand(ir[i].src1);
+        if (ir[i].src2.kind != OPND_NONE) {
+            putchar(' ');
+            print_operand(ir[i].src2);
+        }
+        putchar('\n');
+    }
+}
+
+// 照 C 的語意在 AST 上求值；溢位、除以零等未定義行為回傳 false，原因放在 *ub
+// 一個敘述的節點在 ast[first..root] 是後序排列，依序掃過去時子節點的值都已經在 vals 裡
+bool interpret(int first, int root, int* var, int* res, const char** ub) {
+    static int* vals = NULL;
+    static int val_cap = 0;
+    RESERVE(vals, val_cap, ast_len);
+    for (int now = first; now <= root; now++) {
+        int left, right;
+        long long val;
+        switch (ast[now].kind) {
+            case ASSIGN:
+                var[get_node_info(ast[now].lhs).val - 'x'] = vals[now] = vals[ast[now].rhs];
+                continue;
+            case ADD:
+            case SUB:
+            case MUL:
+            case DIV:
+            case REM:
+                left = vals[ast[now].lhs], right = vals[ast[now].rhs];
+                if ((ast[now].kind == DIV || ast[now].kind == REM) && right == 0) {
+                    *ub = "division by zero";
+                    return false;
+                }
+                if ((ast[now].kind == DIV || ast[now].kind == REM) && left == -2147483647 - 1 && right == -1) {
+                    *ub = "signed integer overflow";  // INT_MIN % -1 在 long long 下是 0，要另外檢查
+                    return false;
+                }
+                if (ast[now].kind == ADD)
+                    val = (long long)left + right;
+                else if (ast[now].kind == SUB)
+                    val = (long long)left - right;
+                else if (ast[now].kind == MUL)
+                    val = (long long)left * right;
+                else
+                    val = ast[now].kind == DIV ? (long long)left / right : (long long)left % right;
+                break;
+            case PREINC:
+            case PREDEC:
+            case POSTINC:
+            case POSTDEC:
+                left = var[get_node_info(ast[now].mid).val - 'x'];
+                val = (long long)left + (ast[now].kind == PREINC || ast[now].kind == POSTINC ? 1 : -1);
+                if (val < -2147483647 - 1 || val > 2147483647)
+                    break;
+                var[get_node_info(ast[now].mid).val - 'x'] = (int)val;
+                vals[now] = ast[now].kind == PREINC || ast[now].kind == PREDEC ? (int)val : left;
+                continue;
+            case IDENTIFIER:
+                vals[now] = var[ast[now].val - 'x'];
+                continue;
+            case CONSTANT:
+                vals[now] = ast[now].val;
+                continue;
+            case MINUS:
+                val = -(long long)vals[ast[now].mid];
+                break;
+            case PLUS:
+            case LPAR:
+            case RPAR:
+                vals[now] = vals[ast[now].mid];
+                continue;
+            default:
+                err("Unexpected AST node during interpretation.");
+        }
+        if (val < -2147483647 - 1 || val > 2147483647) {
+            *ub = "signed integer overflow";
+            return false;
+        }
+        vals[now] = (int)val;
+    }
+    *res = vals[root];
+    return true;
+}
+
+// 參數是一組 x y z，或是每行一組 x y z 的檔案；沒有參數時和 ASMC 一樣用 2 3 5
+int run_interpreter(int* roots, int count, int argc, char* argv[]) {
+    FILE* file = NULL;
+    int init[3] = {2, 3, 5}, var[3], res;
+    const char* ub = NULL;
+    if (argc == 1) {
+        file = fopen(argv[0], "r");
+        if (file == NULL) {
+            perror(argv[0]);
+            return 1;
+        }
+    } else if (argc == 3) {
+        for (int i = 0; i < 3; i++)
+            init[i] = atoi(argv[i]);
+    } else if (argc != 0) {
+        fputs("usage: main -r [x y z | input file] < program\n", stderr);
+        return 1;
+    }
+    while (file == NULL || fscanf(file, "%d %d %d", &init[0], &init[1], &init[2]) == 3) {
+        memcpy(var, init, sizeof(var));
+        bool ok = true;
+        for (int i = 0; ok && i < count; i++)
+            ok = interpret(i == 0 ? 0 : roots[i - 1] + 1, roots[i], var, &res, &ub);  // 敘述的節點緊接在前一個的後面
+        if (ok)
+            printf("x, y, z = %d, %d, %d\n", var[0], var[1], var[2]);
+        else
+            printf("Undefined behavior: %s\n", ub);
+        if (file == NULL)
+            break;
+    }
+    if (file != NULL)
+        fclose(file);
+    return 0;
 }
 
 void token_print(Token* in, size_t len) {
@@ -1163,24 +2598,30 @@ void token_print(Token* in, size_t len) {
     }
 }
 
-void AST_print(AST* head) {
-    static char indent_str[MAX_LENGTH] = "  ";
-    static int indent = 2;
+void AST_print(int head) {
+    static char* indent_str = NULL;  // 跟著樹的深度加長
+    static int indent = 2, indent_cap = 0;
     const static char KindName[][20] = {"Assign", "Add", "Sub", "Mul", "Div", "Rem",
                                         "PreInc", "PreDec", "PostInc", "PostDec", "Identifier", "Constant",
                                         "Parentheses", "Parentheses", "Plus", "Minus"};
     const static char format[] = "%s\n";
     const static char format_str[] = "%s, <%s = %s>\n";
     const static char format_val[] = "%s, <%s = %d>\n";
-    if (head == NULL)
+    if (head == NIL)
         return;
-    char* indent_now = indent_str + indent;
+    if (indent + 3 > indent_cap) {
+        indent_cap = indent_cap ? indent_cap * 2 : 64;
+        indent_str = (char*)realloc(indent_str, indent_cap);
+        if (indent == 2)
+            strcpy(indent_str, "  ");
+    }
+    int indent_now = indent;  // 子樹會讓 indent_str 被 realloc，只記位置
     indent_str[indent - 1] = '-';
     fprintf(stderr, "%s", indent_str);
     indent_str[indent - 1] = ' ';
     if (indent_str[indent - 2] == '`')
         indent_str[indent - 2] = ' ';
-    switch (head->kind) {
+    switch (ast[head].kind) {
         case ASSIGN:
         case ADD:
         case SUB:
@@ -1195,23 +2636,39 @@ void AST_print(AST* head) {
         case RPAR:
         case PLUS:
         case MINUS:
-            fprintf(stderr, format, KindName[head->kind]);
+            fprintf(stderr, format, KindName[ast[head].kind]);
             break;
         case IDENTIFIER:
-            fprintf(stderr, format_str, KindName[head->kind], "name", (char*)&(head->val));
+            fprintf(stderr, format_str, KindName[ast[head].kind], "name", (char*)&(ast[head].val));
             break;
         case CONSTANT:
-            fprintf(stderr, format_val, KindName[head->kind], "value", head->val);
+            fprintf(stderr, format_val, KindName[ast[head].kind], "value", ast[head].val);
             break;
         default:
             fputs("=== unknown AST type ===", stderr);
     }
     indent += 2;
-    strcpy(indent_now, "| ");
-    AST_print(head->lhs);
-    strcpy(indent_now, "` ");
-    AST_print(head->mid);
-    AST_print(head->rhs);
+    strcpy(indent_str + indent_now, "| ");
+    AST_print(ast[head].lhs);
+    strcpy(indent_str + indent_now, "` ");
+    AST_print(ast[head].mid);
+    AST_print(ast[head].rhs);
     indent -= 2;
-    (*indent_now) = '\0';
-}
\ No newline at end of file
+    indent_str[indent_now] = '\0';
+}
+void IR_print() {
+    const static char OpName[][8] = {"add", "sub", "mul", "div", "rem", "load", "store"};
+    for (int i = 0; i < ir_len; i++) {
+        Operand opnd[3] = {ir[i].dst, ir[i].src1, ir[i].src2};
+        fprintf(stderr, "<Stmt = %3d>: %-5s", ir[i].stmt, OpName[ir[i].op]);
+        for (int j = 0; j < 3; j++) {
+            if (opnd[j].kind == OPND_REG)
+                fprintf(stderr, " v%d", opnd[j].val);
+            else if (opnd[j].kind == OPND_IMM)
+                fprintf(stderr, " %d", opnd[j].val);
+            else if (opnd[j].kind == OPND_MEM)
+                fprintf(stderr, " [%d]", opnd[j].val);
+        }
+        fputc('\n', stderr);
+    }
+}